@@ -7,376 +7,3532 @@
 #include "Arduino.h"
 #include "SWire.h"
 #include <string.h>
-#include "stringQueue.h"
+#include "messageQueue.h"
+#include "crc8.h"
+#include "deltaCodec.h"
 
-stringQueue_t _in_messages;
-stringQueue_t _out_messages;
-volatile char currentCommand = NO_DATA;
+// Cores SWireClient::sleep can put to sleep
+#if defined(__AVR__) || defined(SWIRE_HOST)
+#include <avr/sleep.h>
+#define CLIENT_CAN_SLEEP 1
+#else
+#define CLIENT_CAN_SLEEP 0
+#endif
 
-volatile bool bufferAlocFailed = false;
+// The pins of Wire, which recoverBus clocks unless told otherwise
+#if defined(PIN_WIRE_SDA) && defined(PIN_WIRE_SCL)
+#define WIRE_SDA_PIN PIN_WIRE_SDA
+#define WIRE_SCL_PIN PIN_WIRE_SCL
+#else
+#define WIRE_SDA_PIN NO_RECOVERY_PIN
+#define WIRE_SCL_PIN NO_RECOVERY_PIN
+#endif
 
-const byte numChars = 32;
-char receivedChars[numChars];
-boolean newData = false;
+// Clients registered for the receive and request trampolines
+static SWireClientBase *_client_instances[MAX_CLIENT_INSTANCES];
 
-/** @brief Reads a packet from the specified stream if one is available
- *
- *  If the data in the stream contains a full packet, the packet will be put
- *  into the return buffer and the return code will indicate it'_s validity.
- *  If there is not enough data in the stream buffer for a full packet, the
- *  function not populate the buffer and the return code will indicate no new
- *  packet.
- *
- *  Returned data DOES include the address as the first byte of the buffer.
+#if CHECK_CRC8
+#define CHECK_INIT CRC8_INIT
+#else
+#define CHECK_INIT 0
+#endif
+
+#if ENABLE_STATS
+#define STAT(x) (x)
+#else
+#define STAT(x) ((void)0)
+#endif
+
+#if ENABLE_TRACE
+#define TRACE_START(name) unsigned long name = micros()
+#define TRACE_EVENT(...) traceEvent(__VA_ARGS__)
+
+// Shared by every master and client in the firmware. Events from the main
+// loop are written with interrupts off; ISRs don't nest, so theirs are not.
+static swireTraceEvent_t _trace[TRACE_DEPTH];
+static volatile uint8_t _trace_head;
+static volatile uint8_t _trace_tail;
+static volatile uint16_t _trace_lost; // Overwritten before they were read
+
+/** @brief Adds an event to the trace, overwriting the oldest if it is full
  *
- *  @param buffer A pointer to the buffer to populate with the possible packet
- *  @return A status code indicating the status of the packet:
- *            0 - No new packet, buffer is returned empty.
- *            1 - New packet in buffer, packet is valid.
- *           -1 - New packet in buffer, packet failed parity check.
+ *  @param phase    One of the TRACE_ phases
+ *  @param address  The client the event is for
+ *  @param bytes    As the phase says
+ *  @param result   As the phase says
+ *  @param start    micros() at the start of the phase
+ *  @param in_isr   Whether this is called from an ISR
  */
-int readPacket(char *buffer)
+static void traceEvent(uint8_t phase, uint8_t address, uint8_t bytes, int result,
+                       unsigned long start, bool in_isr)
 {
-  static int in_packet = 0;
-  static int index = 0;
-  static char buf[MAX_MSG_LEN + 1];
-  static char data_parity = 0;
-  static int escape_next = 0;
-  char rc;
-  int passed_parity = 0;
+  unsigned long elapsed = micros() - start;
+  if (!in_isr)
+  {
+    noInterrupts();
+  }
+  uint8_t head = _trace_head;
+  if ((uint8_t)(head - _trace_tail) >= TRACE_DEPTH)
+  {
+    _trace_tail = _trace_tail + 1;
+    _trace_lost = _trace_lost + 1;
+  }
+  swireTraceEvent_t *event = &_trace[head & (TRACE_DEPTH - 1)];
+  event->time_us = start;
+  event->duration_us = (elapsed > 0xFFFF) ? 0xFFFF : elapsed;
+  event->address = address;
+  event->phase = phase;
+  event->bytes = bytes;
+  event->result = result;
+  _trace_head = head + 1;
+  if (!in_isr)
+  {
+    interrupts();
+  }
+}
 
-  while (Wire.available() > 0)
+/** @brief takes the oldest events out of the trace
+ *
+ *  @param events      Where to copy them to
+ *  @param max_events  The most events to take
+ *  @return The number of events taken
+ */
+uint8_t swireTraceRead(swireTraceEvent_t *events, uint8_t max_events)
+{
+  uint8_t taken = 0;
+  for (; taken < max_events; taken++)
   {
-    rc = Wire.read();
-    if (rc == START)
+    noInterrupts();
+    uint8_t tail = _trace_tail;
+    bool empty = (tail == _trace_head);
+    if (!empty)
     {
-      in_packet = 1;
-      data_parity = START;
-      index = 0;
+      events[taken] = _trace[tail & (TRACE_DEPTH - 1)];
+      _trace_tail = tail + 1;
     }
-    else if (in_packet == 1)
+    interrupts();
+    if (empty)
     {
-      data_parity ^= rc;
-      if (rc != END)
-      {
-
-        buf[index] = rc;
-        escape_next = 0;
-        index++;
-      }
-      if (rc == END || index >= MAX_MSG_LEN)
-      {
-        index--;
-        buf[index] = '\0'; //purposefully overwrite parity byte.
-        strcpy(buffer, buf);
-        passed_parity = ((data_parity & 0x7F) == 0);
-        index = 0;
-        in_packet = 0;
-        data_parity = 0;
-        if (passed_parity)
-        {
-          return 1;
-        }
-        else
-        {
-          return -1;
-        }
-      }
+      break;
     }
   }
-  return 0;
+  return taken;
 }
 
-/** @brief Writes a packet to the I2C bus.
- * 
- *  @param message  A pointer to the message to send, first byte should be
-                      a client address, message should be null terminated,
-                      however the null byte will not be sent over the wire.
- *  @return A status code indicating the whether or not the message was sent
- *            - Currently this function will always succeed
+/** @brief writes out and empties the trace, oldest event first
+ *
+ *  The first line counts the events lost since the last dump, the second
+ *  names the comma separated fields of the lines that follow, one per
+ *  event. Phases are the numbers of the TRACE_ phases.
+ *
+ *  @param out  Where to write it, e.g. Serial
  */
-int sendPacket(char *message)
+void swireTraceDump(Print &out)
 {
-  char data_parity = 0;
-
-  if (strlen(message) == 0)
-  {
-    return 0; // Should only happen on library failure
-  }
-  for (int i = 0; message[i] != 0; i++)
+  swireTraceEvent_t event;
+  noInterrupts();
+  uint16_t lost = _trace_lost;
+  _trace_lost = 0;
+  interrupts();
+  out.print("# lost ");
+  out.print((unsigned long)lost);
+  out.println();
+  out.print("time_us,duration_us,phase,address,bytes,result");
+  out.println();
+  while (swireTraceRead(&event, 1) == 1)
   {
-    data_parity = data_parity ^ (uint8_t)message[i];
+    out.print((unsigned long)event.time_us);
+    out.print(',');
+    out.print((unsigned long)event.duration_us);
+    out.print(',');
+    out.print((unsigned long)event.phase);
+    out.print(',');
+    out.print((unsigned long)event.address);
+    out.print(',');
+    out.print((unsigned long)event.bytes);
+    out.print(',');
+    out.print((long)event.result);
+    out.println();
   }
+}
+
+/** @brief drops every event in the trace */
+void swireTraceClear()
+{
+  noInterrupts();
+  _trace_tail = _trace_head;
+  _trace_lost = 0;
+  interrupts();
+}
+#else
+#define TRACE_START(name) ((void)0)
+#define TRACE_EVENT(...) ((void)0)
+#endif
+
+#if ENABLE_STATS
+/** @brief Adds one sample to a set of latency counters */
+static void addLatencySample(swireStats_t *stats, uint32_t elapsed)
+{
+  stats->latency_min_us = (elapsed < stats->latency_min_us) ? elapsed : stats->latency_min_us;
+  stats->latency_max_us = (elapsed > stats->latency_max_us) ? elapsed : stats->latency_max_us;
+  stats->latency_total_us += elapsed;
+  stats->latency_samples++;
+}
+#endif
 
-  Wire.beginTransmission(message[0]);
-  Wire.write(START);
-  for (int i = 0; message[i] != 0; i++)
+/** @brief Hands a received message to the handler for it, if any
+ *
+ *  A dispatch table entry for the message's first byte comes first, then
+ *  handler.
+ *
+ *  @param message   The message
+ *  @param table     The dispatch table, may be NULL
+ *  @param count     The number of entries in table
+ *  @param context   Passed to the table's handlers
+ *  @param handler   The handler for anything the table doesn't take, its
+ *                   handler may be NULL
+ *  @return Whether a handler took the message
+ */
+/** @brief packs a message at the end of a batch
+ *
+ *  @param batch  The batch to add to
+ *  @param data   The message data
+ *  @param length The number of bytes in data
+ *  @return A status code indicating success or failure, 0 when the batch
+ *          has no room left for the message
+ */
+static int packBatch(swireBatch_t *batch, const uint8_t *data, size_t length)
+{
+  if (batch->length + 1 + length > MAX_BATCH_LEN)
   {
-    Wire.write(message[i]);
+    return 0;
   }
-  Wire.write((START ^ data_parity ^ END));
-  Wire.write(END);
-  Wire.endTransmission();
+  batch->data[batch->length++] = (uint8_t)length;
+  memcpy(&batch->data[batch->length], data, length);
+  batch->length += length;
+  batch->count++;
   return 1;
 }
 
-void receiveEvent(int howMany)
+static bool dispatchMessage(const swireMessage_t *message, const swireDispatchEntry_t *table,
+                            uint8_t count, void *context, const swireHandler_t *handler)
 {
-  char *buffer = (char *)malloc(MAX_MSG_LEN + 1);
-  if (buffer == NULL)
-  { // Fail if buffer allocation failed
-    bufferAlocFailed = true;
-    return;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (table[i].type == message->data[0])
+    {
+      table[i].handler(message->address, message->data, message->length, context);
+      return true;
+    }
   }
+  if (handler->handler == NULL)
+  {
+    return false;
+  }
+  handler->handler(message->address, message->data, message->length, handler->context);
+  return true;
+}
 
-  int result = readPacket(buffer); //TO DO: do something with result
+/** @brief Adds one byte to a packet or reply CHECK */
+static inline uint8_t checkUpdate(uint8_t checksum, uint8_t data)
+{
+#if CHECK_CRC8
+  return crc8Update(checksum, data);
+#else
+  return checksum ^ data;
+#endif
+}
 
-  currentCommand = buffer[1];
+// readPacket states, in the order the fields appear on the wire
+enum
+{
+  PACKET_IDLE,
+  PACKET_ADDRESS,
+  PACKET_COMMAND,
+  PACKET_SEQ,
+  PACKET_LENGTH,
+  PACKET_DATA,
+  PACKET_CHECK,
+  PACKET_END
+};
 
-  if (currentCommand != PING && currentCommand != READ && currentCommand != NO_DATA)
+/** @brief Finds the record for the next message of the packet being read
+ *
+ *  Falls back to the reader's scratch record when the queue has no room left.
+ */
+static swireMessage_t *nextRecord(packetReader_t *reader, messageQueue_t *queue)
+{
+  swireMessage_t *message = (swireMessage_t *)messageQueueReserveAt(queue, reader->records);
+  if (message == NULL)
   {
-    stringQueueAdd(&_in_messages, buffer);
+    message = &reader->scratch;
+    reader->dropped = true;
   }
   else
   {
-    free(buffer);
+    reader->records++;
+  }
+  message->address = reader->address;
+  return message;
+}
+
+/** @brief Puts a packet reader in its initial state
+ *
+ *  @param reader   The reader to initialize
+ *  @param msg_len  The longest message the reader's queue can hold
+ */
+void packetReaderInit(packetReader_t *reader, uint8_t msg_len)
+{
+  memset(reader, 0, sizeof(*reader));
+  reader->msg_len = msg_len;
+  reader->state = PACKET_IDLE;
+  reader->command = NO_DATA;
+}
+
+/** @brief Feeds one received byte to a packet reader
+ *
+ *  This is readPacket's state machine, for bytes that were buffered rather
+ *  than read from the bus directly.
+ *
+ *  @param reader  The parser state for this bus
+ *  @param queue   The queue to assemble WRITE and BATCH messages in
+ *  @param rc      The byte received
+ *  @param command Set to the packet's COMMAND byte when a packet is returned
+ *  @param seq     Set to the packet's SEQ byte when a packet is returned
+ *  @param count   Set to the number of queue records filled by the packet
+ *  @return A status code as for readPacket, 0 until rc completes a packet
+ */
+int packetReaderFeed(packetReader_t *reader, messageQueue_t *queue, uint8_t rc,
+                     char *command, uint8_t *seq, uint8_t *count)
+{
+  switch (reader->state)
+  {
+  case PACKET_IDLE:
+    if (rc == (uint8_t)START)
+    {
+      reader->checksum = CHECK_INIT;
+      reader->state = PACKET_ADDRESS;
+    }
+    return 0;
+  case PACKET_ADDRESS:
+    reader->address = rc;
+    reader->state = PACKET_COMMAND;
+    break;
+  case PACKET_COMMAND:
+    reader->command = (char)rc;
+    reader->state = PACKET_SEQ;
+    break;
+  case PACKET_SEQ:
+    reader->seq = rc;
+    reader->state = PACKET_LENGTH;
+    break;
+  case PACKET_LENGTH:
+  {
+    bool message = (reader->command == WRITE || reader->command == BROADCAST ||
+                    reader->command == REPLAY);
+    if (rc > ((reader->command == BATCH) ? MAX_BATCH_LEN
+              : message                  ? reader->msg_len
+                                         : MSG_LEN_LIMIT))
+    {
+      reader->state = PACKET_IDLE; // Can't be one of ours, resync on next START
+      return 0;
+    }
+    reader->remaining = rc;
+    reader->records = 0;
+    reader->valid = true;
+    reader->dropped = false;
+    reader->message_left = 0;
+    if (reader->command != BATCH)
+    {
+      reader->message = message ? nextRecord(reader, queue) : &reader->scratch;
+      reader->message->length = rc;
+      reader->message_left = rc;
+    }
+    reader->state = (rc == 0) ? PACKET_CHECK : PACKET_DATA;
+    break;
+  }
+  case PACKET_DATA:
+    reader->remaining--;
+    if (reader->message_left == 0)
+    { // Length of the next message in a BATCH
+      if (rc != 0 && rc <= reader->msg_len && rc <= reader->remaining)
+      {
+        reader->message = nextRecord(reader, queue);
+        reader->message->length = rc;
+        reader->message_left = rc;
+      }
+      else
+      { // Skip the rest of the packet
+        reader->valid = false;
+        reader->message = NULL;
+        reader->message_left = reader->remaining;
+      }
+    }
+    else
+    {
+      if (reader->message != NULL)
+      {
+        reader->message->data[reader->message->length - reader->message_left] = rc;
+      }
+      reader->message_left--;
+    }
+    if (reader->remaining == 0)
+    {
+      reader->state = PACKET_CHECK;
+    }
+    break;
+  case PACKET_CHECK:
+    reader->valid = reader->valid && (reader->checksum == rc) && (reader->message_left == 0);
+    reader->state = PACKET_END;
+    return 0;
+  case PACKET_END:
+    reader->state = PACKET_IDLE;
+    *command = reader->command;
+    *seq = reader->seq;
+    *count = reader->records;
+    if (reader->valid && rc == (uint8_t)END)
+    {
+      return reader->dropped ? 2 : 1;
+    }
+    return -1;
   }
+  reader->checksum = checkUpdate(reader->checksum, rc);
+  return 0;
 }
 
-void requestEvent()
+/** @brief Reads a packet from the specified stream if one is available
+ *
+ *  If the data in the stream contains a full packet, the messages it carries
+ *  will be put into the queue and the return code will indicate it's
+ *  validity. If there is not enough data in the stream buffer for a full
+ *  packet, the function will return and the return code will indicate no new
+ *  packet, keeping its progress in reader. Any other packet data (e.g. the
+ *  limit sent with READ_BATCH) is left in reader->scratch.
+ *
+ *  Fields are consumed by position using the packet's LENGTH byte, so the
+ *  data may hold any byte value. Messages are assembled directly in the
+ *  queue's free records but are not committed; the caller commits the
+ *  returned count once it has checked the result.
+ *
+ *  @param wire    The bus to read from
+ *  @param reader  The parser state for this bus
+ *  @param queue   The queue to assemble WRITE and BATCH messages in
+ *  @param command Set to the packet's COMMAND byte when a packet is returned
+ *  @param seq     Set to the packet's SEQ byte when a packet is returned
+ *  @param count   Set to the number of queue records filled by the packet
+ *  @return A status code indicating the status of the packet:
+ *            0 - No new packet, nothing was filled.
+ *            1 - New packet read, packet is valid.
+ *            2 - New packet read, packet is valid but not all of its
+ *                messages fit in the queue.
+ *           -1 - New packet read, packet failed its CHECK or
+ *                was malformed.
+ */
+int readPacket(TwoWire &wire, packetReader_t *reader, messageQueue_t *queue,
+               char *command, uint8_t *seq, uint8_t *count)
 {
-  if (currentCommand == NO_DATA)
+  while (wire.available() > 0)
   {
-    Wire.write(NO_DATA);
+    int result = packetReaderFeed(reader, queue, wire.read(), command, seq, count);
+    if (result != 0)
+    {
+      return result;
+    }
   }
-  else if (currentCommand != READ)
+  return 0;
+}
+
+/** @brief Writes a packet to the I2C bus.
+ *
+ *  @param wire     The bus to write to
+ *  @param address  The client address to send the packet to
+ *  @param command  The packet's COMMAND byte
+ *  @param seq      The packet's SEQ byte
+ *  @param data     The data to send, may be NULL when length is 0
+ *  @param length   The number of data bytes, at most MAX_BATCH_LEN
+ *  @return A status code indicating the whether or not the message was sent
+ *            - Fails if the data is too long or the bus reports an error
+ */
+int sendPacket(TwoWire &wire, uint8_t address, char command, uint8_t seq, const uint8_t *data, uint8_t length)
+{
+  return sendPacketTo(wire, address, address, command, seq, data, length);
+}
+
+/** @brief Writes a packet with an ADDRESS other than the one it is sent to
+ *
+ *  As sendPacket, for BROADCAST and REPLAY packets, whose ADDRESS is their
+ *  target.
+ *
+ *  @param wire         The bus to write to
+ *  @param bus_address  The I2C address to send the packet to, 0 for a
+ *                      general call
+ *  @param address      The packet's ADDRESS byte
+ *  @param command      The packet's COMMAND byte
+ *  @param seq          The packet's SEQ byte
+ *  @param data         The data to send, may be NULL when length is 0
+ *  @param length       The number of data bytes, at most MAX_BATCH_LEN
+ *  @return A status code as for sendPacket
+ */
+int sendPacketTo(TwoWire &wire, uint8_t bus_address, uint8_t address, char command,
+                 uint8_t seq, const uint8_t *data, uint8_t length)
+{
+  uint8_t checksum = CHECK_INIT;
+  TRACE_START(trace_start);
+
+  if (length > MAX_BATCH_LEN)
   {
-    Wire.write(ACK);
+    return 0; // Should only happen on library failure
   }
-  else if (stringQueueIsEmpty(&_out_messages))
+  checksum = checkUpdate(checksum, address);
+  checksum = checkUpdate(checksum, (uint8_t)command);
+  checksum = checkUpdate(checksum, seq);
+  checksum = checkUpdate(checksum, length);
+  for (uint8_t i = 0; i < length; i++)
   {
-    Wire.write('\0');
+    checksum = checkUpdate(checksum, data[i]);
   }
-  else
+
+  wire.beginTransmission(bus_address);
+  wire.write(START);
+  wire.write(address);
+  wire.write(command);
+  wire.write(seq);
+  wire.write(length);
+  if (length > 0)
   {
-    char *message;
-    message = stringQueueRemove(&_out_messages);
-    Wire.write((unsigned char *)message, strlen(message));
-    free(message);
+    wire.write(data, length);
   }
+  wire.write(checksum);
+  wire.write(END);
+  int sent = wire.endTransmission() == 0;
+  TRACE_EVENT(TRACE_SEND, bus_address, PACKET_OVERHEAD + length, sent, trace_start, false);
+  return sent;
+}
 
-  currentCommand = NO_DATA;
+/** @brief The broadcast SEQ after seq, which skips 0 so that 0 can mean none */
+static inline uint8_t nextBroadcastSeq(uint8_t seq)
+{
+  seq++;
+  return (seq == 0) ? 1 : seq;
 }
 
+// Standard bus clocks, fastest first: Fast-mode Plus, Fast-mode, Standard-mode
+static const uint32_t _bus_clocks[] = {1000000, 400000, 100000};
+#define BUS_CLOCK_COUNT (sizeof(_bus_clocks) / sizeof(_bus_clocks[0]))
+
 /** @brief Creates a new SWireMaster object
- * 
- *  @param i2c_addr I2C address of SWireMaster device
+ *
+ *  Called by SWireMasterT, which owns the storage.
+ *
+ *  @param wire           The bus to master, Wire unless the board has several
+ *  @param max_clients    The number of records in clients and client_state
+ *  @param msg_len        The longest message the queues can hold
+ *  @param clients        Storage for the IDs of the clients found
+ *  @param client_state   Storage for the clients' polling state
+ *  @param tx_seq         Storage for max_clients + 1 sequence numbers
+ *  @param in_storage     Storage for in_depth message records
+ *  @param in_depth       The incoming queue's capacity, a power of two
+ *  @param out_storage    Storage for out_depth message records
+ *  @param out_depth      The outgoing queue's capacity, a power of two
+ *  @param broadcast_storage Storage for MAX_GROUPS + 1 message records
+ *  @param handlers       Storage for max_clients + 1 handlers
  *  @return A new initialized SWireMaster object
  */
-SWireMaster::SWireMaster()
+SWireMasterBase::SWireMasterBase(TwoWire &wire, uint8_t max_clients, uint8_t msg_len,
+                                 uint8_t *clients, clientState_t *client_state, uint8_t *tx_seq,
+                                 uint8_t *in_storage, uint8_t in_depth,
+                                 uint8_t *out_storage, uint8_t out_depth,
+                                 uint8_t *broadcast_storage, swireHandler_t *handlers,
+                                 uint8_t *delta_refs)
+    : _wire(wire)
 {
+  _max_clients = max_clients;
+  _msg_len = msg_len;
+  _clients = clients;
+  _client_state = client_state;
+  _tx_seq = tx_seq;
   _num_clients = 0;
-  memset(_clients, 0, MAX_CLIENTS);
-  stringQueueInit(&_in_messages, MAX_MASTER_QUEUE_SIZE);
-  Wire.begin();
+  _batch_client = 0;
+  _out_retries = 0;
+  _out_sent = 0;
+  _rescan_interval = RESCAN_INTERVAL;
+  _rescan_next = 0;
+  _last_rescan = 0;
+  _scan_next = 0;
+  _attention_pin = NO_ATTENTION_PIN;
+  _last_scan = 0;
+  _clock_target = BUS_CLOCK;
+  _clock = BUS_CLOCK;
+  _link_transactions = 0;
+  _link_errors = 0;
+  _bus_suspect = false;
+  _bus_failures = 0;
+  _last_recovery = 0;
+  // Another bus's pins aren't known, see setRecoveryPins
+  _sda_pin = (&wire == &Wire) ? WIRE_SDA_PIN : NO_RECOVERY_PIN;
+  _scl_pin = (&wire == &Wire) ? WIRE_SCL_PIN : NO_RECOVERY_PIN;
+  _broadcasts = broadcast_storage;
+  memset(_broadcast_seqs, 0, sizeof(_broadcast_seqs));
+  _broadcast_last = 0;
+  _stream_client = 0;
+  _stream_result = 0;
+  _stream_acked = 0;
+  _handlers = handlers;
+  _delta_refs = delta_refs;
+  _dispatch_table = NULL;
+  _dispatch_count = 0;
+  _dispatch_context = NULL;
+  _dispatching = false;
+  memset(_clients, 0, _max_clients);
+  memset(_tx_seq, 0, _max_clients + 1);
+  memset(_handlers, 0, (_max_clients + 1) * sizeof(swireHandler_t));
+#if ENABLE_STATS
+  resetStats();
+#endif
+  messageQueueInit(&_in_messages, (char *)in_storage, in_depth, MESSAGE_RECORD_LEN(msg_len));
+  messageQueueInit(&_out_messages, (char *)out_storage, out_depth, MESSAGE_RECORD_LEN(msg_len));
+  beginBus();
+}
+
+/** @brief Joins the bus as its master, at the current clock */
+void SWireMasterBase::beginBus()
+{
+  _wire.begin();
+  _wire.setClock(_clock);
+#if defined(WIRE_HAS_TIMEOUT)
+  _wire.setWireTimeout(WIRE_TIMEOUT_US, true); // Reset the TWI when it hangs
+#endif
 }
 
 /** @brief sends a data string to the specified client.
  *
- *  Internally, this function enqueues the data to be written when convenient.
- *  This function fails when there is not enough memory to enqueue the message
- *  or when the queue is full.
+ *  The string is sent without its null terminator.
+ *
+ *  @param client_id  The ID of the client to write to
+ *  @param data       The null terminated string to write to the given client
+ *  @return A status code indicating success or failure
+ */
+int SWireMasterBase::sendData(uint8_t client_id, char *data)
+{
+  return sendData(client_id, (const uint8_t *)data, strlen(data));
+}
+
+/** @brief sends binary data to the specified client.
+ *
+ *  Internally, this function enqueues the data to be written by service.
+ *  This function fails when the client ID is out of range, when the client
+ *  is quarantined, when the data is empty or longer than MsgLen, or when
+ *  the queue is full.
  *
  *  @param client_id  The ID of the client to write to
  *  @param data       The data to write to the given client
+ *  @param length     The number of bytes in data
  *  @return A status code indicating success or failure
  */
-int SWireMaster::sendData(uint8_t client_id, char *data)
+int SWireMasterBase::sendData(uint8_t client_id, const uint8_t *data, size_t length)
 {
-  char *new_message = (char *)malloc(MAX_MSG_LEN + 1);
-  if (new_message == NULL)
+  if (client_id == 0 || client_id > _max_clients || length == 0 || length > _msg_len ||
+      isQuarantined(client_id))
   {
     return 0;
   }
-  strcpy(new_message + 1, data);
-  new_message[0] = (char)client_id;
-  sendPacket(new_message);
-  if (Wire.requestFrom((int)client_id, 1) != 0)
+  swireMessage_t *new_message = (swireMessage_t *)messageQueueReserve(&_out_messages);
+  if (new_message == NULL)
   {
-    return 1;
+    STAT(_stats.queue_full++);
+    return 0;
   }
-  return 0;
+  new_message->address = client_id;
+  new_message->length = (uint8_t)length;
+  memcpy(new_message->data, data, length);
+  messageQueueCommit(&_out_messages);
+  return 1;
 }
 
-/** @brief Retrieve data if there is any to get
+/** @brief starts collecting messages to send to a client in one transaction
  *
- *  @param buffer A string to populate with the possible data
- *  @return The ID of the client that sent the message, 0 if no data.
+ *  Unlike sendData, a batch is written immediately by endBatch, bypassing
+ *  the queue. Any batch that was started but not ended is discarded. The
+ *  batch is kept apart from the queue, so calling service() or getData()
+ *  between beginBatch and endBatch leaves it as it was.
+ *
+ *  @param client_id  The ID of the client the batch is for
+ *  @return A status code indicating success or failure
  */
-int SWireMaster::getData(char *buffer)
+int SWireMasterBase::beginBatch(uint8_t client_id)
 {
-  static unsigned long lastTime = 0;
-
-  if (millis() - lastTime > 100)
+  if (client_id == 0 || client_id > _max_clients)
   {
-    lastTime = millis();
-    scanMessages();
+    return 0;
   }
+  _batch_client = client_id;
+  _batch.length = 0;
+  _batch.count = 0;
+  return 1;
+}
 
-  int client_id;
-  char *message;
-  if (stringQueueIsEmpty(&_in_messages))
+/** @brief adds a message to the current batch
+ *
+ *  This function fails when no batch was started, when the data is empty or
+ *  longer than MsgLen, or when the batch has no room left for it. In
+ *  that case the batch is left as it was and can still be sent.
+ *
+ *  @param data   The data to add to the batch
+ *  @param length The number of bytes in data
+ *  @return A status code indicating success or failure
+ */
+int SWireMasterBase::addToBatch(const uint8_t *data, size_t length)
+{
+  if (_batch_client == 0 || length == 0 || length > _msg_len)
   {
     return 0;
   }
-  message = stringQueueRemove(&_in_messages);
-  client_id = message[0];
-  strcpy(buffer, message + 1);
-  free(message);
-  return client_id;
+  return packBatch(&_batch, data, length);
 }
 
-/** @brief runs a client search
+/** @brief sends the current batch in a single transaction
  *
- *  A client search consists of pinging each client address between 1 and 
- *  MAX_CLIENTS. If the client responds, then it gets put in our array.
+ *  A batch of one message is sent as a plain WRITE. When the client may
+ *  have taken the batch without its ACK getting back, the batch is not
+ *  resent later, so this function fails though the messages may arrive.
  *
- *  @return The number of clients found
+ *  @return A status code indicating success or failure
  */
-int SWireMaster::identifyClients()
+int SWireMasterBase::endBatch()
 {
-  char rc;
-  unsigned long start_millis;
-  char temp[MAX_MSG_LEN];
-  char message[3] = {(char)1, PING, '\0'};
-  _num_clients = 0;
-  memset(_clients, 0, MAX_CLIENTS);
-
-  for (int i = 1; i < MAX_CLIENTS; i++)
+  uint8_t client_id = _batch_client;
+  _batch_client = 0;
+  if (client_id == 0)
   {
-    message[0] = (char)i;
-    sendPacket(message);
-    if (Wire.requestFrom(i, 1) != 0)
-    {
-      rc = Wire.read();
-      if (rc == ACK)
-      {
-        _clients[_num_clients] = i;
-        _num_clients++;
-      }
-    }
+    return 0;
   }
-  return _num_clients;
+  if (_batch.count == 0)
+  {
+    return 1;
+  }
+  int result = writeBatch(client_id, &_batch);
+  if (result < 0)
+  {
+    _tx_seq[client_id]++; // Nobody resends it, don't let it shadow the next one
+  }
+  return (result > 0) ? 1 : 0;
 }
 
-/** @brief gets the client array and number of clients
- *
- *  If the clients argument is NULL, the number of clients will still be
- *  returned, but it will not attempt to populate the array.
+/** @brief writes a batch with writeFrame, a batch of one as a plain WRITE
  *
- *  @param clients  a pointer to memory of at least MAX_CLIENTS size to put
-                      the the clients into 
- *  @return The number of clients found
+ *  @param client_id  The ID of the client the batch is for
+ *  @param batch      The messages to write
+ *  @return The result of writeFrame
  */
-int SWireMaster::getClients(uint8_t *clients)
+int SWireMasterBase::writeBatch(uint8_t client_id, const swireBatch_t *batch)
 {
-  if (clients != NULL)
+  if (batch->count == 1)
   {
-    memcpy(clients, _clients, _num_clients);
+    return writeFrame(client_id, WRITE, &batch->data[1], batch->data[0], 1);
   }
-  return _num_clients;
+  return writeFrame(client_id, BATCH, batch->data, batch->length, batch->count);
 }
 
-void SWireMaster::scanMessages()
+/** @brief broadcasts a data string to every client or to a group.
+ *
+ *  The string is sent without its null terminator.
+ *
+ *  @param group  BROADCAST_ALL, or the group to send to
+ *  @param data   The null terminated string to broadcast
+ *  @return A status code indicating success or failure
+ */
+int SWireMasterBase::broadcastData(uint8_t group, char *data)
 {
-  char rc;
-  char msg[3] = {(char)1, READ, '\0'};
+  return broadcastData(group, (const uint8_t *)data, strlen(data));
+}
 
-  for (byte i = 0; i < _num_clients; i++)
+/** @brief broadcasts binary data to every client or to a group.
+ *
+ *  The data is written straight away in one general call, bypassing the
+ *  queue, and kept as the group's latest broadcast until the next one.
+ *  Clients that miss it, whether to a bus error or because they were not
+ *  listening, have it replayed when they are next polled. So once the data
+ *  is kept the broadcast has succeeded, even if the general call failed.
+ *
+ *  This function fails when the group is above MAX_GROUPS, or when the
+ *  data is empty or longer than MsgLen.
+ *
+ *  @param group  BROADCAST_ALL, or the group to send to
+ *  @param data   The data to broadcast
+ *  @param length The number of bytes in data
+ *  @return A status code indicating success or failure
+ */
+int SWireMasterBase::broadcastData(uint8_t group, const uint8_t *data, size_t length)
+{
+  if (group > MAX_GROUPS || length == 0 || length > _msg_len)
   {
-    char *message = (char *)malloc(MAX_MSG_LEN + 1);
-    msg[0] = (char)_clients[i];
-    sendPacket(msg);
-    if (Wire.requestFrom((int)_clients[i], 8) > 1)
-    {
-      rc = Wire.read();
-      if (rc != '\0' && rc != ACK && rc != NO_DATA)
-      {
-        for (byte idx = 0; idx < MAX_MSG_LEN; idx++)
-        {
-          message[idx] = rc;
-          rc = Wire.read();
-          if (rc == (char)0xff)
-          {
-            message[idx + 1] = '\0';
-            break;
-          }
-        }
-        stringQueueAdd(&_in_messages, message);
-        continue;
-      }
-    }
-    free(message);
+    return 0;
+  }
+  swireMessage_t *record = (swireMessage_t *)(_broadcasts + group * MESSAGE_RECORD_LEN(_msg_len));
+  record->address = group;
+  record->length = (uint8_t)length;
+  memcpy(record->data, data, length);
+  _broadcast_last = nextBroadcastSeq(_broadcast_last);
+  _broadcast_seqs[group] = _broadcast_last;
+
+  if (!sendPacketTo(_wire, 0, group, BROADCAST, _broadcast_last, record->data, record->length))
+  {
+    STAT(_stats.bus_errors++); // Not a link error, general calls may go unanswered
   }
+  // Address 0 + packet
+  STAT(_stats.messages++);
+  STAT(_stats.frames++);
+  STAT(_stats.payload_bytes += length);
+  STAT(_stats.overhead_bytes += 1 + PACKET_OVERHEAD);
+  return 1;
 }
 
-/** @brief Creates a new SWireClient object
- * 
- *  @param port The underlying stream object used for communication.
+/** @brief Reads a stream from memory, for beginStream */
+static bool memorySource(uint32_t offset, uint8_t *data, uint8_t length, void *context)
+{
+  memcpy(data, (const uint8_t *)context + offset, length);
+  return true;
+}
 
- *  @return A new initialized SWireClient object
+/** @brief streams a buffer in memory to a client.
+ *
+ *  As the other beginStream, reading from data, which must stay valid
+ *  until the stream ends.
+ *
+ *  @param client_id  The ID of the client to stream to
+ *  @param data       The data to stream
+ *  @param length     The number of bytes in data
+ *  @return A status code indicating success or failure
  */
-SWireClient::SWireClient(uint8_t client_number)
+int SWireMasterBase::beginStream(uint8_t client_id, const uint8_t *data, uint32_t length)
 {
-  _client_number = client_number;
-  stringQueueInit(&_in_messages, MAX_CLIENT_QUEUE_SIZE);
-  stringQueueInit(&_out_messages, MAX_CLIENT_QUEUE_SIZE);
-  Wire.begin(client_number);
-  Wire.onReceive(receiveEvent);
-  Wire.onRequest(requestEvent);
+  return beginStream(client_id, length, memorySource, (void *)data);
 }
 
-/** @brief sends a data string to the master.
+/** @brief starts streaming data to a client.
  *
- *  Internally, this function enqueues the data to be written when convenient.
- *  This function fails when there is not enough memory to enqueue the message
- *  or when the queue is full.
+ *  The data is written by service, in frames of STREAM_CHUNK bytes read
+ *  from source just before they are sent, STREAM_WINDOW frames per call,
+ *  alongside the usual polls and writes. Frames the client did not take
+ *  are read from source again and resent. The stream fails when the client
+ *  refuses it, when source returns false, or when the client takes nothing
+ *  for STREAM_TIMEOUT ms. Check on it with streamStatus.
+ *
+ *  This function fails when the client ID is out of range, when length is
+ *  0, or while another stream is running.
  *
- *  @param data The data to write to the given client
+ *  @param client_id  The ID of the client to stream to
+ *  @param length     The number of bytes in the stream
+ *  @param source     The callback supplying the bytes
+ *  @param context    Passed to source unchanged
  *  @return A status code indicating success or failure
  */
-int SWireClient::sendData(char *data)
+int SWireMasterBase::beginStream(uint8_t client_id, uint32_t length, swireStreamSource_t source,
+                                 void *context)
 {
-  char *new_message = (char *)malloc(MAX_MSG_LEN + 1);
-  if (new_message == NULL)
+  if (client_id == 0 || client_id > _max_clients || length == 0 || source == NULL ||
+      _stream_client != 0)
   {
-    Serial.println("Failed memory allocation");
     return 0;
   }
-  strcpy(new_message + 1, data);
-  new_message[0] = (char)_client_number;
-  stringQueueAdd(&_out_messages, new_message);
+  _stream_client = client_id;
+  _stream_opened = false;
+  _stream_frame = 0;
+  _stream_progress = millis();
+  _stream_window = STREAM_WINDOW;
+  _stream_length = length;
+  _stream_acked = 0;
+  _stream_source = source;
+  _stream_context = context;
   return 1;
 }
 
-/** @brief Retrieve data if there is any to get
+/** @brief tells how the current or last stream is getting on
  *
- *  @param buffer A string to populate with the possible data
- *  @return A status code indicating whether data was retrieved
+ *  @param acknowledged  Set to the number of bytes the client has taken,
+ *                       may be NULL
+ *  @return A status code indicating the state of the stream:
+ *            1 - The stream is running.
+ *            0 - No stream was started, or the last one was delivered.
+ *           -1 - The last stream failed or was cancelled.
+ */
+int SWireMasterBase::streamStatus(uint32_t *acknowledged)
+{
+  if (acknowledged != NULL)
+  {
+    *acknowledged = _stream_acked;
+  }
+  return (_stream_client != 0) ? 1 : _stream_result;
+}
+
+/** @brief abandons the current stream, if any */
+void SWireMasterBase::cancelStream()
+{
+  if (_stream_client != 0)
+  {
+    endStream(-1);
+  }
+}
+
+/** @brief Finishes the current stream with the result streamStatus gives */
+void SWireMasterBase::endStream(int8_t result)
+{
+  _stream_client = 0;
+  _stream_result = result;
+}
+
+/** @brief writes the next window of the current stream
+ *
+ *  Opens the stream first if the client hasn't accepted it yet, asking
+ *  again each call until STREAM_TIMEOUT if the open is lost. The frames
+ *  go back to back, then a single reply says how many the client took, so
+ *  the bus only turns around once per window. Whatever it did not take is
+ *  sent again in the next window (go-back-N). The window halves whenever
+ *  frames are lost and grows back by one frame per full window, up to
+ *  STREAM_WINDOW, which lets a CLIENT_DEFERRED_RX client with a small
+ *  RX_BUFFER_SIZE keep up.
  */
-int SWireClient::getData(char *buffer)
+void SWireMasterBase::pumpStream()
 {
-  if (bufferAlocFailed)
+  uint8_t client = _stream_client;
+  if (client == 0)
   {
-    Serial.print(F("bufferAlocFailed"));
+    return;
+  }
+  clientState_t *state = findClient(client);
+  if (state != NULL && quarantined(state))
+  { // The stream waits for it, up to STREAM_TIMEOUT
+    if (millis() - _stream_progress > STREAM_TIMEOUT)
+    {
+      endStream(-1);
+    }
+    return;
   }
-  char *message;
-  if (stringQueueIsEmpty(&_in_messages))
+  if (!_stream_opened)
   {
-    return 0;
+    uint8_t length[4];
+    for (uint8_t i = 0; i < 4; i++)
+    {
+      length[i] = (uint8_t)(_stream_length >> (8 * i));
+    }
+    int opened = exchangePacket(client, client, STREAM_OPEN, 0, length, sizeof(length));
+    if (state != NULL)
+    {
+      noteResult(state, opened >= 0);
+    }
+    if (opened == 0)
+    {
+      endStream(-1); // Refused
+      return;
+    }
+    if (opened < 0)
+    { // Lost on the bus, open it again next time
+      STAT(_stats.retries++);
+      if (millis() - _stream_progress > STREAM_TIMEOUT)
+      {
+        endStream(-1);
+      }
+      return;
+    }
+    _stream_opened = true;
   }
-  message = stringQueueRemove(&_in_messages);
-  strcpy(buffer, message + 1);
-  free(message);
-  return 1;
+
+  uint8_t frame[STREAM_CHUNK];
+  uint8_t sent = 0;
+  unsigned long start = micros();
+  for (; sent < _stream_window; sent++)
+  {
+    uint32_t offset = _stream_acked + (uint32_t)sent * STREAM_CHUNK;
+    if (offset >= _stream_length)
+    {
+      break;
+    }
+    uint8_t length = (_stream_length - offset < STREAM_CHUNK) ? _stream_length - offset
+                                                              : STREAM_CHUNK;
+    if (!_stream_source(offset, frame, length, _stream_context))
+    {
+      endStream(-1);
+      return;
+    }
+    if (!sendPacket(_wire, client, STREAM, _stream_frame + sent, frame, length))
+    {
+      break;
+    }
+    // Address + packet
+    STAT(_stats.frames++);
+    STAT(_stats.payload_bytes += length);
+    STAT(_stats.overhead_bytes += 1 + PACKET_OVERHEAD);
+  }
+  int reply = (sent > 0) ? requestReply(client) : -1;
+  for (uint8_t probe = 0; reply == (uint8_t)NAK && probe < MAX_RETRIES; probe++)
+  { // The last frame was damaged, an empty one asks how far the client got
+    reply = sendPacket(_wire, client, STREAM, _stream_frame, NULL, 0) ? requestReply(client) : -1;
+    STAT(_stats.overhead_bytes += 1 + PACKET_OVERHEAD + 2);
+  }
+  recordLatency(start);
+  if (state != NULL)
+  {
+    noteResult(state, reply >= 0);
+  }
+  STAT(_stats.overhead_bytes += 2); // Address + reply
+  _link_transactions += (sent > 0) ? sent : 1; // Each frame is a transaction
+
+  // The reply is the SEQ the client expects next, 7 bits of it
+  uint8_t taken = (reply >= 0 && reply < 0x80) ? (uint8_t)(reply - _stream_frame) & 0x7F : 0;
+  if (taken > sent)
+  {
+    taken = 0;
+  }
+  if (taken < sent)
+  { // Lost frames, perhaps to a client that can't buffer a whole window
+    _link_errors++; // Once, the rest were only dropped for coming after it
+    _stream_window = (_stream_window > 1) ? _stream_window / 2 : 1;
+  }
+  else if (_stream_window < STREAM_WINDOW)
+  {
+    _stream_window++;
+  }
+  if (taken == 0)
+  {
+    STAT(_stats.retries++);
+    if (reply < 0)
+    {
+      STAT(_stats.bus_errors++);
+    }
+    if (millis() - _stream_progress > STREAM_TIMEOUT)
+    {
+      endStream(-1);
+    }
+    return;
+  }
+  _stream_progress = millis();
+  _stream_frame += taken;
+  _stream_acked += (uint32_t)taken * STREAM_CHUNK;
+  if (_stream_acked >= _stream_length)
+  {
+    _stream_acked = _stream_length;
+    endStream(0);
+  }
+}
+
+/** @brief replays the latest broadcast to each target to one client
+ *
+ *  The broadcasts go oldest first, in the order they were sent. A client
+ *  that took one already drops it again by its SEQ.
+ *
+ *  @param client_id  The ID of the client to replay to
+ *  @return Whether the client acknowledged every replay
+ */
+bool SWireMasterBase::replayBroadcasts(uint8_t client_id)
+{
+  bool sent[MAX_GROUPS + 1] = {false};
+  for (;;)
+  {
+    int8_t oldest = -1;
+    for (uint8_t group = 0; group <= MAX_GROUPS; group++)
+    {
+      if (_broadcast_seqs[group] != 0 && !sent[group] &&
+          (oldest < 0 || (uint8_t)(_broadcast_last - _broadcast_seqs[group]) >
+                             (uint8_t)(_broadcast_last - _broadcast_seqs[oldest])))
+      {
+        oldest = group;
+      }
+    }
+    if (oldest < 0)
+    {
+      return true;
+    }
+    sent[oldest] = true;
+    swireMessage_t *record = (swireMessage_t *)(_broadcasts + oldest * MESSAGE_RECORD_LEN(_msg_len));
+    unsigned long start = micros();
+    int result = exchangePacket(client_id, oldest, REPLAY, _broadcast_seqs[oldest],
+                                record->data, record->length);
+    recordLatency(start);
+    STAT(_stats.messages++);
+    STAT(_stats.frames++);
+    STAT(_stats.payload_bytes += record->length);
+    STAT(_stats.overhead_bytes += 1 + PACKET_OVERHEAD + 2);
+    if (result <= 0)
+    {
+      return false;
+    }
+  }
+}
+
+#if ENABLE_STATS
+/** @brief gets the master's bus counters
+ *
+ *  @return A pointer to the counters, which stay valid for the lifetime of
+ *          the master
+ */
+const swireStats_t *SWireMasterBase::getStats()
+{
+  return &_stats;
+}
+
+/** @brief gets the poll counters for one client
+ *
+ *  @param client_id  The ID of the client
+ *  @return A pointer to the counters, NULL if the client is unknown. It
+ *          stays valid until identifyClients.
+ */
+const swirePollStats_t *SWireMasterBase::getClientStats(uint8_t client_id)
+{
+  clientState_t *state = findClient(client_id);
+  return (state != NULL) ? &state->stats : NULL;
+}
+
+/** @brief zeroes the master's counters, including every client's */
+void SWireMasterBase::resetStats()
+{
+  memset(&_stats, 0, sizeof(_stats));
+  _stats.latency_min_us = 0xFFFFFFFF;
+  for (uint8_t i = 0; i < _num_clients; i++)
+  {
+    memset(&_client_state[i].stats, 0, sizeof(swirePollStats_t));
+  }
+}
+#endif
+
+/** @brief gets the most messages one of the master's queues has held
+ *
+ *  A queue that never comes close to its depth can be made smaller, one
+ *  that reaches it is dropping or refusing messages. The mark is kept from
+ *  the master's creation on, resetStats leaves it alone.
+ *
+ *  @param outgoing  Whether to ask about the sendData queue rather than the
+ *                   queue of received messages
+ *  @return The most messages the queue has held at once
+ */
+uint8_t SWireMasterBase::getQueueHighWater(bool outgoing)
+{
+  return messageQueueHighWater(outgoing ? &_out_messages : &_in_messages);
+}
+
+/** @brief adds the time since start to the latency counters */
+void SWireMasterBase::recordLatency(unsigned long start)
+{
+#if ENABLE_STATS
+  addLatencySample(&_stats, micros() - start);
+#else
+  (void)start;
+#endif
+}
+
+/** @brief writes a packet to a client and waits for its ACK
+ *
+ *  A packet that is not acknowledged is sent again straight away with the
+ *  same SEQ, up to MAX_RETRIES times or until TRANSACTION_TIMEOUT_US has
+ *  passed, so the client can drop copies it already has. That includes a
+ *  packet whose answer could not be read, since the client may have taken
+ *  it and only the ACK got lost.
+ *
+ *  @param client_id  The ID of the client to write to
+ *  @param address    The packet's ADDRESS, client_id but for a REPLAY
+ *  @param command    WRITE, BATCH or REPLAY
+ *  @param seq        The packet's SEQ
+ *  @param data       The packet's DATA
+ *  @param length     The number of bytes in data
+ *  @return A status code indicating the result of the exchange:
+ *            1 - The client acknowledged the packet.
+ *            0 - The client did not, or the time ran out.
+ *           -1 - Some answer could not be read, the client may or may not
+ *                have taken the packet.
+ */
+int SWireMasterBase::exchangePacket(uint8_t client_id, uint8_t address, char command,
+                                    uint8_t seq, const uint8_t *data, uint8_t length)
+{
+  unsigned long start = micros();
+  bool unknown = false; // Whether the client may have taken a copy already
+  for (uint8_t attempt = 0; attempt <= MAX_RETRIES; attempt++)
+  {
+    if (attempt > 0)
+    {
+      if (micros() - start > TRANSACTION_TIMEOUT_US)
+      {
+        break;
+      }
+      STAT(_stats.retries++);
+    }
+    bool sent = sendPacketTo(_wire, client_id, address, command, seq, data, length);
+    int reply = sent ? requestReply(client_id) : -1;
+    _link_transactions++;
+    if (reply != (uint8_t)ACK && reply != (uint8_t)BUSY)
+    {
+      _link_errors++; // A busy client is slow, not losing bytes
+    }
+    if (reply < 0)
+    {
+      STAT(_stats.bus_errors++);
+      if (!sent)
+      {
+        return -1; // Nobody there, resending won't help
+      }
+      unknown = true; // Only the ACK may have been lost, ask again
+    }
+    if (reply == (uint8_t)ACK)
+    {
+      return 1;
+    }
+  }
+  return unknown ? -1 : 0;
+}
+
+/** @brief writes a WRITE or BATCH packet and waits for the client's ACK
+ *
+ *  The packet is retried by exchangePacket, and the client's SEQ only moves
+ *  on once it is acknowledged. A packet that may have got through without
+ *  its ACK leaves the SEQ as it was, so it must be sent again unchanged or
+ *  skipped with the SEQ moved on by the caller. Nothing is sent to a
+ *  quarantined client.
+ *
+ *  @param client_id  The ID of the client to write to
+ *  @param command    WRITE or BATCH
+ *  @param data       The packet's DATA
+ *  @param length     The number of bytes in data
+ *  @param messages   The number of messages carried in data
+ *  @return The result of exchangePacket, 0 for a quarantined client
+ */
+int SWireMasterBase::writeFrame(uint8_t client_id, char command, const uint8_t *data,
+                            uint8_t length, uint8_t messages)
+{
+  clientState_t *state = findClient(client_id);
+  if (state != NULL && quarantined(state))
+  {
+    return 0;
+  }
+  unsigned long start = micros();
+  int result = exchangePacket(client_id, client_id, command, _tx_seq[client_id], data, length);
+  if (result > 0)
+  {
+    _tx_seq[client_id]++;
+  }
+  recordLatency(start);
+  TRACE_EVENT(TRACE_WRITE, client_id, length, result, start, false);
+  if (state != NULL)
+  {
+    noteResult(state, result > 0);
+  }
+
+#if ENABLE_STATS
+  // Address + packet, then address + ACK
+  uint8_t payload = (command == BATCH) ? length - messages : length;
+  _stats.messages += messages;
+  _stats.frames++;
+  _stats.payload_bytes += payload;
+  _stats.overhead_bytes += 1 + PACKET_OVERHEAD + length - payload + 2;
+#else
+  (void)messages;
+#endif
+  return result;
+}
+
+/** @brief Retrieve data if there is any to get
+ *
+ *  @param buffer A string of at least MsgLen + 1 bytes to populate with
+ *                the possible data. The data is null terminated.
+ *  @return The ID of the client that sent the message, 0 if no data.
+ */
+int SWireMasterBase::getData(char *buffer)
+{
+  uint8_t client_id = 0;
+  int length = getData((uint8_t *)buffer, _msg_len, &client_id);
+  buffer[length] = '\0';
+  return client_id;
+}
+
+/** @brief Retrieve binary data if there is any to get
+ *
+ *  Data beyond size bytes is discarded.
+ *
+ *  @param buffer     A buffer to populate with the possible data
+ *  @param size       The size of buffer in bytes
+ *  @param client_id  Set to the ID of the client that sent the message
+ *  @return The number of bytes copied into buffer, 0 if no data.
+ */
+int SWireMasterBase::getData(uint8_t *buffer, size_t size, uint8_t *client_id)
+{
+  const uint8_t *data;
+  int length = peekData(&data, client_id);
+  if (length == 0)
+  {
+    return 0;
+  }
+  if ((size_t)length > size)
+  {
+    length = (int)size;
+  }
+  memcpy(buffer, data, length);
+  releaseData();
+  return length;
+}
+
+/** @brief Look at the oldest received message without copying it
+ *
+ *  The data stays valid until releaseData is called. Calling peekData again
+ *  before that returns the same message.
+ *
+ *  @param data       Set to point at the message's data, NULL if no data
+ *  @param client_id  Set to the ID of the client that sent the message
+ *  @return The number of bytes at data, 0 if no data.
+ */
+int SWireMasterBase::peekData(const uint8_t **data, uint8_t *client_id)
+{
+  service();
+
+  swireMessage_t *message = (swireMessage_t *)messageQueuePeek(&_in_messages);
+  if (message == NULL)
+  {
+    *data = NULL;
+    return 0;
+  }
+  *data = message->data;
+  *client_id = message->address;
+  return message->length;
+}
+
+/** @brief Frees the message returned by peekData */
+void SWireMasterBase::releaseData()
+{
+  messageQueuePop(&_in_messages);
+}
+
+/** @brief sets the handler for messages from every client
+ *
+ *  As the other onMessage, for the clients that have no handler of their
+ *  own.
+ *
+ *  @param handler  The handler, NULL to leave messages to getData
+ *  @param context  Passed to handler unchanged
+ *  @return A status code indicating success or failure
+ */
+int SWireMasterBase::onMessage(swireMessageHandler_t handler, void *context)
+{
+  _handlers[0].handler = handler;
+  _handlers[0].context = context;
+  return 1;
+}
+
+/** @brief sets the handler for messages from one client
+ *
+ *  service hands each message to the handler as soon as it is read, in
+ *  place, and drops it once the handler returns. Messages go out in the
+ *  order they were received; one that no handler takes is left for getData,
+ *  and holds the ones behind it until it is taken. A handler may send data
+ *  but must not take any with getData or peekData.
+ *
+ *  This function fails when the client ID is out of range.
+ *
+ *  @param client_id  The ID of the client
+ *  @param handler    The handler, NULL to fall back on the handler for
+ *                    every client
+ *  @param context    Passed to handler unchanged
+ *  @return A status code indicating success or failure
+ */
+int SWireMasterBase::onMessage(uint8_t client_id, swireMessageHandler_t handler, void *context)
+{
+  if (client_id == 0 || client_id > _max_clients)
+  {
+    return 0;
+  }
+  _handlers[client_id].handler = handler;
+  _handlers[client_id].context = context;
+  return 1;
+}
+
+/** @brief sets handlers picked by the first byte of each message
+ *
+ *  An entry whose type matches a message's first byte takes it ahead of
+ *  any onMessage handler, whichever client sent it. The table is searched
+ *  in order and must stay valid while it is set, a static const array
+ *  being the usual choice.
+ *
+ *  @param table    The table, NULL for none
+ *  @param count    The number of entries in table
+ *  @param context  Passed to the table's handlers unchanged
+ */
+void SWireMasterBase::setDispatchTable(const swireDispatchEntry_t *table, uint8_t count,
+                                       void *context)
+{
+  _dispatch_table = table;
+  _dispatch_count = (table != NULL) ? count : 0;
+  _dispatch_context = context;
+}
+
+/** @brief hands received messages over to their handlers, oldest first */
+void SWireMasterBase::dispatchMessages()
+{
+  if (_dispatching)
+  {
+    return;
+  }
+  _dispatching = true;
+  swireMessage_t *message;
+  while ((message = (swireMessage_t *)messageQueuePeek(&_in_messages)) != NULL)
+  {
+    swireHandler_t *handler = &_handlers[message->address];
+    if (!dispatchMessage(message, _dispatch_table, _dispatch_count, _dispatch_context,
+                         (handler->handler != NULL) ? handler : &_handlers[0]))
+    {
+      break;
+    }
+    messageQueuePop(&_in_messages);
+  }
+  _dispatching = false;
+}
+
+/** @brief runs a client search
+ *
+ *  A client search consists of probing each client address between 1 and
+ *  Clients. Addresses that acknowledge on the bus are then pinged, and
+ *  if the client responds, then it gets put in our array. Every client found
+ *  starts with the default polling intervals.
+ *
+ *  @return The number of clients found
+ */
+int SWireMasterBase::identifyClients()
+{
+  _num_clients = 0;
+  memset(_clients, 0, _max_clients);
+
+  for (int i = 1; i <= _max_clients; i++)
+  {
+    if (probeClient(i))
+    {
+      addClient(i);
+    }
+  }
+  negotiateClock();
+  return _num_clients;
+}
+
+/** @brief sets how often service looks for clients added at runtime
+ *
+ *  Each time the interval elapses, one address that is not a known client
+ *  is probed, so a full pass over the addresses takes Clients intervals
+ *  without ever stalling other traffic.
+ *
+ *  @param interval_ms  The time between probes in ms, 0 to disable
+ */
+void SWireMasterBase::setRescanInterval(uint16_t interval_ms)
+{
+  _rescan_interval = interval_ms;
+  _last_rescan = millis();
+}
+
+/** @brief watches a shared attention line instead of polling blindly
+ *
+ *  Every client given the same pin with its own setAttentionPin pulls the
+ *  line low while it has messages queued. From then on clients are only
+ *  polled while the line is low, at their minimum interval, and every
+ *  ATTENTION_IDLE_POLL ms otherwise. The pin's pull-up is enabled; long or
+ *  busy lines may want an external one as well.
+ *
+ *  @param pin  The pin the line is wired to, NO_ATTENTION_PIN to go back to
+ *              polling every client
+ */
+void SWireMasterBase::setAttentionPin(uint8_t pin)
+{
+  _attention_pin = pin;
+  if (pin != NO_ATTENTION_PIN)
+  {
+    pinMode(pin, INPUT_PULLUP);
+  }
+}
+
+/** @brief checks whether a SWire client is listening at an address
+ *
+ *  A bare address write is tried first so that empty addresses cost a
+ *  single byte; only addresses that acknowledge are sent a PING. Probes run
+ *  at 100 kHz, or slower if setBusClock asked for less, so that any client
+ *  can answer whatever clock the others negotiated.
+ *
+ *  @param client_id  The address to check
+ *  @return Whether a client answered the PING
+ */
+bool SWireMasterBase::probeClient(uint8_t client_id)
+{
+  uint32_t probe_clock = _bus_clocks[BUS_CLOCK_COUNT - 1];
+  bool found = false;
+
+  probe_clock = (_clock < probe_clock) ? _clock : probe_clock;
+  if (probe_clock != _clock)
+  {
+    _wire.setClock(probe_clock);
+  }
+  _wire.beginTransmission(client_id);
+  if (_wire.endTransmission() == 0)
+  {
+    found = pingClient(client_id);
+  }
+  if (probe_clock != _clock)
+  {
+    _wire.setClock(_clock);
+  }
+  return found;
+}
+
+/** @brief sends a client a PING and checks its answer
+ *
+ *  The PING offers delta encoding when ENABLE_COMPRESSION is set. Either
+ *  way the client starts its next reply without a delta reference.
+ *
+ *  @param client_id  The ID of the client
+ *  @return Whether the client answered ACK or ACK_DELTA
+ */
+bool SWireMasterBase::pingClient(uint8_t client_id)
+{
+  static const uint8_t offer = PING_DELTA;
+  if (!sendPacket(_wire, client_id, PING, 0, &offer, ENABLE_COMPRESSION ? 1 : 0))
+  {
+    return false;
+  }
+  int answer = requestReply(client_id);
+  return answer == (uint8_t)ACK || answer == (uint8_t)ACK_DELTA;
+}
+
+/** @brief starts a client's delta encoding over from no reference
+ *
+ *  Used when a delta encoded message can't be decoded, which takes a
+ *  reference the two ends don't agree on.
+ *
+ *  @param index  The index of the client in _clients
+ *  @return Whether the client answered the PING
+ */
+bool SWireMasterBase::resyncClient(uint8_t index)
+{
+  _client_state[index].delta_length = 0;
+  return pingClient(_clients[index]);
+}
+
+/** @brief sets the fastest bus clock the master may use
+ *
+ *  The bus is switched to the fastest standard clock (1 MHz, 400 kHz or
+ *  100 kHz) no faster than clock_hz, or to clock_hz itself if that is
+ *  slower than 100 kHz. identifyClients then settles on the fastest of
+ *  these that every client handles, and service slows the bus down one step
+ *  whenever errors build up.
+ *
+ *  @param clock_hz  The highest clock to use, in Hz
+ */
+void SWireMasterBase::setBusClock(uint32_t clock_hz)
+{
+  _clock_target = clock_hz;
+  _clock = clock_hz;
+  for (uint8_t i = 0; i < BUS_CLOCK_COUNT; i++)
+  {
+    if (_bus_clocks[i] <= clock_hz)
+    {
+      _clock = _bus_clocks[i];
+      break;
+    }
+  }
+  _wire.setClock(_clock);
+  _link_transactions = 0;
+  _link_errors = 0;
+}
+
+/** @brief gets the bus clock currently in use
+ *
+ *  @return The clock in Hz
+ */
+uint32_t SWireMasterBase::getBusClock()
+{
+  return _clock;
+}
+
+/** @brief switches to the next standard clock slower than the current one
+ *
+ *  @return Whether there was a slower clock to switch to
+ */
+bool SWireMasterBase::slowDownClock()
+{
+  for (uint8_t i = 0; i < BUS_CLOCK_COUNT; i++)
+  {
+    if (_bus_clocks[i] < _clock)
+    {
+      _clock = _bus_clocks[i];
+      _wire.setClock(_clock);
+      return true;
+    }
+  }
+  return false;
+}
+
+/** @brief picks the fastest clock that every client passes a link check at
+ *
+ *  Starting from the clock set with setBusClock, each client is sent
+ *  LINK_CHECK_PINGS PINGs, which it only ACKs if their CHECK is intact. Any
+ *  failure drops the bus to the next slower clock and starts over, down to
+ *  100 kHz, which is used without a check.
+ */
+void SWireMasterBase::negotiateClock()
+{
+  setBusClock(_clock_target);
+  // Nothing to gain from checking the slowest clock, there's no fallback
+  while (_clock > _bus_clocks[BUS_CLOCK_COUNT - 1])
+  {
+    bool passed = true;
+    for (uint8_t i = 0; i < _num_clients && passed; i++)
+    {
+      for (uint8_t ping = 0; ping < LINK_CHECK_PINGS && passed; ping++)
+      {
+        passed = pingClient(_clients[i]);
+      }
+    }
+    if (passed)
+    {
+      return;
+    }
+    slowDownClock();
+  }
+}
+
+/** @brief slows the bus down when too many recent transactions failed
+ *
+ *  More than CLOCK_MAX_ERRORS failures within CLOCK_CHECK_WINDOW
+ *  transactions drops the clock one step and starts a new window.
+ */
+void SWireMasterBase::checkClock()
+{
+  if (_link_errors > CLOCK_MAX_ERRORS)
+  {
+    slowDownClock();
+  }
+  else if (_link_transactions < CLOCK_CHECK_WINDOW)
+  {
+    return;
+  }
+  _link_transactions = 0;
+  _link_errors = 0;
+}
+
+/** @brief reads a client's one byte answer to a packet
+ *
+ *  A client that answers BUSY is asked again, up to MAX_BUSY_POLLS times
+ *  or until TRANSACTION_TIMEOUT_US has passed.
+ *
+ *  @param client_id  The ID of the client to read from
+ *  @return The answer, BUSY if the client stayed busy, -1 if it did not
+ *          answer at all
+ */
+int SWireMasterBase::requestReply(uint8_t client_id)
+{
+  unsigned long start = micros();
+  for (uint8_t polls = 0;; polls++)
+  {
+    TRACE_START(trace_start);
+    uint8_t received = _wire.requestFrom((int)client_id, 1);
+    TRACE_EVENT(TRACE_REQUEST, client_id, 1, received, trace_start, false);
+    if (received != 1)
+    {
+      return -1;
+    }
+    uint8_t rc = _wire.read();
+    if (rc != (uint8_t)BUSY || polls >= MAX_BUSY_POLLS ||
+        micros() - start > TRANSACTION_TIMEOUT_US)
+    {
+      return rc;
+    }
+  }
+}
+
+/** @brief adds a client to _clients with the default polling intervals */
+void SWireMasterBase::addClient(uint8_t client_id)
+{
+  clientState_t *state = &_client_state[_num_clients];
+  state->min_interval = POLL_INTERVAL_MIN;
+  state->max_interval = POLL_INTERVAL_MAX;
+  state->interval = POLL_INTERVAL_MIN;
+  state->next_poll = millis();
+  state->rx_next = 0;
+  state->rx_synced = false;
+  state->replay = false;
+  state->failures = 0;
+  state->backoff = 0;
+  state->quarantine_end = 0;
+  state->delta_length = 0; // The probe's PING reset the client's as well
+  state->burst = false;
+#if ENABLE_STATS
+  memset(&state->stats, 0, sizeof(state->stats));
+#endif
+  _clients[_num_clients] = client_id;
+  _num_clients++;
+}
+
+/** @brief finds the state kept for a client
+ *
+ *  @param client_id  The ID of the client
+ *  @return The client's state, NULL if it is not a known client
+ */
+clientState_t *SWireMasterBase::findClient(uint8_t client_id)
+{
+  for (uint8_t i = 0; i < _num_clients; i++)
+  {
+    if (_clients[i] == client_id)
+    {
+      return &_client_state[i];
+    }
+  }
+  return NULL;
+}
+
+/** @brief tells whether a client is being left alone after failing
+ *
+ *  @param client_id  The ID of the client
+ *  @return Whether the client is quarantined, false for unknown clients
+ */
+bool SWireMasterBase::isQuarantined(uint8_t client_id)
+{
+  clientState_t *state = findClient(client_id);
+  return state != NULL && quarantined(state);
+}
+
+/** @brief tells whether a client's quarantine is still running */
+bool SWireMasterBase::quarantined(clientState_t *state)
+{
+  return state->backoff != 0 && (long)(millis() - state->quarantine_end) < 0;
+}
+
+/** @brief counts the outcome of a write or poll towards quarantine and
+ *         bus recovery
+ *
+ *  A Wire timeout or a run of failures across the bus marks the bus for
+ *  recoverBus. QUARANTINE_FAILURES failures in a row quarantine the client,
+ *  and every failure after that while it is let back in doubles the
+ *  quarantine. A success ends it.
+ *
+ *  @param state  The state of the client the transaction was with
+ *  @param ok     Whether the transaction succeeded
+ */
+void SWireMasterBase::noteResult(clientState_t *state, bool ok)
+{
+#if defined(WIRE_HAS_TIMEOUT)
+  if (_wire.getWireTimeoutFlag())
+  {
+    _wire.clearWireTimeoutFlag();
+    STAT(_stats.timeouts++);
+    _bus_suspect = true;
+  }
+#endif
+  if (ok)
+  {
+    state->failures = 0;
+    state->backoff = 0;
+    _bus_failures = 0;
+    return;
+  }
+  if (_bus_failures < BUS_RECOVERY_FAILURES)
+  {
+    _bus_failures++;
+  }
+  if (_bus_failures >= BUS_RECOVERY_FAILURES)
+  {
+    _bus_suspect = true;
+  }
+  if (state->failures < QUARANTINE_FAILURES)
+  {
+    state->failures++;
+  }
+  if (state->failures < QUARANTINE_FAILURES)
+  {
+    return;
+  }
+  if (state->backoff == 0)
+  {
+    state->backoff = QUARANTINE_MIN;
+    STAT(_stats.quarantines++);
+  }
+  else
+  {
+    state->backoff = (state->backoff > QUARANTINE_MAX / 2) ? QUARANTINE_MAX : state->backoff * 2;
+  }
+  state->quarantine_end = millis() + state->backoff;
+}
+
+/** @brief sets the pins recoverBus clocks to free the bus
+ *
+ *  They default to Wire's SDA and SCL, where the core names them, and to
+ *  none for any other bus. The pins are only touched while the bus is being
+ *  recovered, with Wire stopped.
+ *
+ *  @param sda_pin  The bus's SDA pin, NO_RECOVERY_PIN for none
+ *  @param scl_pin  The bus's SCL pin, NO_RECOVERY_PIN for none
+ */
+void SWireMasterBase::setRecoveryPins(uint8_t sda_pin, uint8_t scl_pin)
+{
+  _sda_pin = sda_pin;
+  _scl_pin = scl_pin;
+}
+
+/** @brief frees a bus that a client is holding SDA low on
+ *
+ *  A client that lost track of a transfer part way through a byte holds SDA
+ *  low until it has clocked the rest out. With Wire stopped, SCL is pulsed
+ *  until SDA is released, BUS_RECOVERY_CLOCKS times at most, then a STOP
+ *  ends whatever the client thought was going on. Both lines are driven as
+ *  open-drain, and each pulse takes 10 us, so this is over in well under a
+ *  millisecond. Wire is restarted even without recovery pins, which resets
+ *  a TWI that hung.
+ */
+void SWireMasterBase::recoverBus()
+{
+  _bus_suspect = false;
+  _bus_failures = 0;
+  _last_recovery = millis();
+  STAT(_stats.recoveries++);
+  _wire.end();
+  if (_sda_pin != NO_RECOVERY_PIN && _scl_pin != NO_RECOVERY_PIN)
+  {
+    // Wire leaves both as inputs, so these only prepare the open-drain pulls
+    digitalWrite(_sda_pin, LOW);
+    digitalWrite(_scl_pin, LOW);
+    for (uint8_t i = 0; i < BUS_RECOVERY_CLOCKS && digitalRead(_sda_pin) == LOW; i++)
+    {
+      pinMode(_scl_pin, OUTPUT);
+      delayMicroseconds(5);
+      pinMode(_scl_pin, INPUT);
+      delayMicroseconds(5);
+    }
+    // STOP: SDA rising while SCL is high
+    pinMode(_sda_pin, OUTPUT);
+    delayMicroseconds(5);
+    pinMode(_sda_pin, INPUT);
+    delayMicroseconds(5);
+  }
+  beginBus();
+}
+
+/** @brief probes the next unknown address if the rescan interval elapsed */
+void SWireMasterBase::rescanClients()
+{
+  if (_rescan_interval == 0 || millis() - _last_rescan < _rescan_interval ||
+      _num_clients >= _max_clients)
+  {
+    return;
+  }
+  _last_rescan = millis();
+
+  // Advance to the next address that is not already a client
+  for (int tries = 0; tries < _max_clients; tries++)
+  {
+    _rescan_next = (_rescan_next >= _max_clients) ? 1 : _rescan_next + 1;
+    if (memchr(_clients, _rescan_next, _num_clients) == NULL)
+    {
+      break;
+    }
+  }
+  if (memchr(_clients, _rescan_next, _num_clients) == NULL && probeClient(_rescan_next))
+  {
+    addClient(_rescan_next);
+  }
+}
+
+/** @brief gets the client array and number of clients
+ *
+ *  If the clients argument is NULL, the number of clients will still be
+ *  returned, but it will not attempt to populate the array.
+ *
+ *  @param clients  a pointer to memory of at least Clients size to put
+                      the the clients into
+ *  @return The number of clients found
+ */
+int SWireMasterBase::getClients(uint8_t *clients)
+{
+  if (clients != NULL)
+  {
+    memcpy(clients, _clients, _num_clients);
+  }
+  return _num_clients;
+}
+
+/** @brief sets the polling interval limits for a client
+ *
+ *  The client is polled every min_ms while it has data, backing off to
+ *  max_ms while it is idle. Limits are reset by identifyClients.
+ *
+ *  @param client_id  The ID of the client to configure, 0 for all clients
+ *  @param min_ms     The shortest polling interval in ms
+ *  @param max_ms     The longest polling interval in ms
+ *  @return A status code indicating success or failure
+ */
+int SWireMasterBase::setPollInterval(uint8_t client_id, uint16_t min_ms, uint16_t max_ms)
+{
+  int found = 0;
+  if (min_ms == 0 || min_ms > max_ms)
+  {
+    return 0;
+  }
+  for (byte i = 0; i < _num_clients; i++)
+  {
+    if (client_id == 0 || _clients[i] == client_id)
+    {
+      clientState_t *state = &_client_state[i];
+      state->min_interval = min_ms;
+      state->max_interval = max_ms;
+      state->interval = min_ms;
+      state->next_poll = millis();
+      found = 1;
+    }
+  }
+  return found;
+}
+
+/** @brief moves data between the master's queues and the clients
+ *
+ *  Writes one window of the current stream and at most one transaction
+ *  from the outbound queue, polls the clients that are due, then probes
+ *  for a new client when the rescan interval has elapsed. Messages
+ *  received go to their onMessage handlers as they arrive. getData calls
+ *  this, so a master that reads data regularly does not need to call it
+ *  separately. A bus that looked stuck is recovered first.
+ */
+void SWireMasterBase::service()
+{
+  if (_bus_suspect && millis() - _last_recovery >= BUS_RECOVERY_INTERVAL)
+  {
+    recoverBus();
+  }
+  pumpStream();
+  flushMessages();
+  scanMessages();
+  dispatchMessages();
+  rescanClients();
+  checkClock();
+}
+
+/** @brief writes the oldest queued messages in a single transaction
+ *
+ *  Consecutive messages for the same client are packed into one BATCH. If
+ *  the client does not acknowledge it, it is retried on the next call; after
+ *  MAX_RETRIES failures the oldest message is dropped. A BATCH the client
+ *  may have taken without its ACK getting back is retried as it was, with
+ *  the same SEQ, and dropped whole. Messages for a quarantined client are
+ *  dropped straight away rather than left to hold up the ones behind them.
+ */
+void SWireMasterBase::flushMessages()
+{
+  swireMessage_t *message = (swireMessage_t *)messageQueuePeek(&_out_messages);
+  while (message != NULL && isQuarantined(message->address))
+  {
+    if (_out_sent > 0)
+    { // Whatever the client got of it, move past its SEQ
+      _tx_seq[message->address]++;
+      _out_sent = 0;
+    }
+    messageQueuePop(&_out_messages);
+    _out_retries = 0;
+    STAT(_stats.dropped++);
+    message = (swireMessage_t *)messageQueuePeek(&_out_messages);
+  }
+  if (message == NULL || _bus_suspect)
+  {
+    return;
+  }
+
+  uint8_t client_id = message->address;
+  _out_frame.length = 0;
+  _out_frame.count = 0;
+  while (message != NULL && message->address == client_id &&
+         (_out_sent == 0 || _out_frame.count < _out_sent) &&
+         packBatch(&_out_frame, message->data, message->length))
+  {
+    message = (swireMessage_t *)messageQueuePeekAt(&_out_messages, _out_frame.count);
+  }
+
+  uint8_t count = _out_frame.count;
+  int result = writeBatch(client_id, &_out_frame);
+  if (result > 0)
+  {
+    messageQueuePopN(&_out_messages, count);
+    _out_retries = 0;
+    _out_sent = 0;
+    return;
+  }
+  if (result < 0)
+  {
+    _out_sent = count; // Resend exactly these, or the client drops new ones as repeats
+  }
+  if (++_out_retries >= MAX_RETRIES)
+  {
+    uint8_t dropped = 1;
+    if (_out_sent > 0)
+    {
+      dropped = _out_sent;
+      _tx_seq[client_id]++;
+      _out_sent = 0;
+    }
+    messageQueuePopN(&_out_messages, dropped);
+    _out_retries = 0;
+    STAT(_stats.dropped += dropped);
+  }
+}
+
+/** @brief polls every client that is due
+ *
+ *  Clients that return data are polled again after their minimum interval,
+ *  idle clients back off exponentially to their maximum interval. A client
+ *  that reports more data pending is read again with READ_BATCH, up to
+ *  POLL_BURST_MAX times, and is due again immediately if it still has more
+ *  after that. Every client due is read once before any of those bursts,
+ *  and the bursts then take turns, one READ_BATCH each. A client reporting
+ *  REPLY_URGENT is read out at once instead, up to URGENT_BURST_MAX times,
+ *  so urgent messages wait behind one READ of each client at most rather
+ *  than behind another client's backlog.
+ *
+ *  With an attention pin, nothing is polled while the line is released,
+ *  except once every ATTENTION_IDLE_POLL ms, and idle clients don't back
+ *  off since the line already says when it is worth asking.
+ *
+ *  Each scan starts from the client after the last one polled, so neither a
+ *  client that always has more nor a full queue cutting the scan short
+ *  keeps the others waiting. A quarantined client is next polled when its
+ *  quarantine ends. The scan stops as soon as the bus looks stuck.
+ */
+void SWireMasterBase::scanMessages()
+{
+  bool attention = (_attention_pin != NO_ATTENTION_PIN);
+  if (attention && digitalRead(_attention_pin) != LOW)
+  {
+    if (ATTENTION_IDLE_POLL == 0 || millis() - _last_scan < ATTENTION_IDLE_POLL)
+    {
+      return;
+    }
+    _last_scan = millis();
+  }
+  TRACE_START(trace_start);
+#if ENABLE_TRACE
+  uint8_t trace_polls = _link_transactions; // pollClient counts each poll
+#endif
+
+  byte first = (_scan_next < _num_clients) ? _scan_next : 0;
+  bool bursting = false;
+  for (byte n = 0; n < _num_clients && !_bus_suspect; n++)
+  {
+    byte i = (first + n) % _num_clients;
+    clientState_t *state = &_client_state[i];
+    unsigned long now = millis();
+    state->burst = false;
+    if ((long)(now - state->next_poll) < 0)
+    {
+      continue;
+    }
+    if (messageQueueIsFull(&_in_messages))
+    {
+      _scan_next = i; // Its turn comes first once there is room
+      TRACE_EVENT(TRACE_SCAN, 0, (uint8_t)(_link_transactions - trace_polls), 0, trace_start,
+                  false);
+      return;
+    }
+    _scan_next = (i + 1 < _num_clients) ? i + 1 : 0;
+
+    int result = pollClient(i, false);
+    if (result == 2 && POLL_BURST_MAX > 1)
+    {
+      state->burst = bursting = true; // Once everyone due has been read
+      continue;
+    }
+    result = burstClient(i, result);
+    if (result == 0 && messageQueueIsFull(&_in_messages))
+    {
+      TRACE_EVENT(TRACE_SCAN, 0, (uint8_t)(_link_transactions - trace_polls), 0, trace_start,
+                  false);
+      return; // Leave messages on the clients if there is nowhere to put them
+    }
+    schedulePoll(state, result, now);
+  }
+
+  // The bursts take turns, so an urgent reply from any of them is read out
+  // within a round rather than after everyone else's backlog
+  for (byte burst = 1; burst < POLL_BURST_MAX && bursting; burst++)
+  {
+    bursting = false;
+    for (byte n = 0; n < _num_clients && !_bus_suspect; n++)
+    {
+      byte i = (first + n) % _num_clients;
+      clientState_t *state = &_client_state[i];
+      if (!state->burst)
+      {
+        continue;
+      }
+      int result = burstClient(i, pollClient(i, true));
+      if (result == 2 && burst + 1 < POLL_BURST_MAX)
+      {
+        bursting = true;
+        continue;
+      }
+      state->burst = false;
+      if (result == 0 && messageQueueIsFull(&_in_messages))
+      {
+        TRACE_EVENT(TRACE_SCAN, 0, (uint8_t)(_link_transactions - trace_polls), 0,
+                    trace_start, false);
+        return; // The rest of the bursts are still due next time
+      }
+      schedulePoll(state, result, millis());
+    }
+  }
+  TRACE_EVENT(TRACE_SCAN, 0, (uint8_t)(_link_transactions - trace_polls), !_bus_suspect,
+              trace_start, false);
+}
+
+/** @brief reads out a client that reported urgent messages, with READ_BATCH
+ *
+ *  @param index   The index of the client in _clients
+ *  @param result  The result of the poll that reported them
+ *  @return The result of the last poll, result itself if it wasn't urgent
+ */
+int SWireMasterBase::burstClient(uint8_t index, int result)
+{
+  for (byte burst = 1; result == 3 && burst < URGENT_BURST_MAX; burst++)
+  {
+    result = pollClient(index, true);
+  }
+  return result;
+}
+
+/** @brief sets when a client polled by scanMessages is next due
+ *
+ *  @param state   The client's state
+ *  @param result  The result of its last poll
+ *  @param now     millis() when it was polled
+ */
+void SWireMasterBase::schedulePoll(clientState_t *state, int result, unsigned long now)
+{
+  if (result > 0 || result == -2 || _attention_pin != NO_ATTENTION_PIN)
+  { // A busy client is about to have an answer
+    state->interval = state->min_interval;
+  }
+  else if (state->interval < state->max_interval)
+  {
+    state->interval = (state->interval > state->max_interval / 2)
+                          ? state->max_interval
+                          : state->interval * 2;
+  }
+  state->next_poll = (result >= 2) ? now : now + state->interval;
+  if (quarantined(state))
+  {
+    state->next_poll = state->quarantine_end;
+  }
+}
+
+/** @brief finds the record for the next message of a client's reply
+ *
+ *  Messages the client sent before, because it missed our acknowledgement,
+ *  go to _scratch and are counted as duplicates instead.
+ *
+ *  @param state    The replying client's state
+ *  @param seq      The message's sequence number
+ *  @param records  The number of records already reserved for the reply
+ *  @return The record to read the message into, NULL if the queue is full
+ */
+swireMessage_t *SWireMasterBase::replyRecord(clientState_t *state, uint8_t seq, uint8_t *records)
+{
+  if (state->rx_synced && (int8_t)(seq - state->rx_next) < 0)
+  {
+    STAT(_stats.duplicates++);
+    return &_scratch;
+  }
+  swireMessage_t *message = (swireMessage_t *)messageQueueReserveAt(&_in_messages, *records);
+  if (message != NULL)
+  {
+    (*records)++;
+  }
+  return message;
+}
+
+/** @brief polls a single client with readMessage and counts the result
+ *
+ *  @param index  The index of the client in _clients
+ *  @param batch  Whether to send READ_BATCH rather than READ
+ *  @return The result of readMessage
+ */
+int SWireMasterBase::pollClient(uint8_t index, bool batch)
+{
+  unsigned long start = micros();
+  int result = readMessage(index, batch);
+  recordLatency(start);
+  TRACE_EVENT(TRACE_POLL, _clients[index], batch, result, start, false);
+  noteResult(&_client_state[index], result != -1); // Busy is not a failure
+  if (result > 0)
+  {
+    dispatchMessages(); // Frees the room for the rest of a burst
+  }
+  _link_transactions++;
+  if (result == -1)
+  {
+    _link_errors++;
+  }
+#if ENABLE_STATS
+  swirePollStats_t *stats = &_client_state[index].stats;
+  stats->polls++;
+  if (result > 0)
+  {
+    stats->hits++;
+  }
+  else if (result == 0 || result == -2)
+  {
+    stats->misses++;
+  }
+  else
+  {
+    stats->errors++;
+  }
+#endif
+  return result;
+}
+
+/** @brief polls a single client for messages
+ *
+ *  A READ fetches one message. A READ_BATCH fetches as many as fit in one
+ *  reply, limited to the room left in _in_messages. The reply's LENGTH is
+ *  read first so that exactly the announced bytes are clocked after it.
+ *
+ *  The READ's SEQ acknowledges every message received so far. Messages the
+ *  client sends again because an earlier acknowledgement was lost are
+ *  recognised by their sequence number and skipped.
+ *
+ *  Once anything was broadcast, the READ also names the latest broadcast,
+ *  and a client that missed it answers MISSED and gets the broadcasts
+ *  replayed instead of being read.
+ *
+ *  Delta encoded messages are decoded against the message before them, the
+ *  first one of the reply against the last one received. One that can't be
+ *  decoded has the client resynced with a PING, and fails the poll.
+ *
+ *  @param index  The index of the client in _clients
+ *  @param batch  Whether to send READ_BATCH rather than READ
+ *  @return A status code indicating the result of the poll:
+ *            0 - The client had no data, there is nowhere to store it, or
+ *                broadcasts were replayed to it.
+ *            1 - Messages were added to _in_messages.
+ *            2 - Messages were added and the client has more pending.
+ *            3 - Like 2, and some of those are urgent.
+ *           -1 - The client did not answer or its reply was invalid.
+ *           -2 - The client answered BUSY, it is still handling a packet.
+ */
+int SWireMasterBase::readMessage(uint8_t index, bool batch)
+{
+  uint8_t client = _clients[index];
+  clientState_t *state = &_client_state[index];
+  uint8_t space = messageQueueSpace(&_in_messages);
+  uint8_t max_length = batch ? MAX_BATCH_LEN : _msg_len;
+  uint8_t ack = state->rx_synced ? state->rx_next : 0;
+  swireMessage_t *message = NULL;
+  uint8_t records = 0;
+  uint8_t messages = 0;
+  uint8_t message_left = 0;
+  uint8_t request[2] = {space, _broadcast_last};
+  uint8_t request_length = (batch ? 1 : 0) + (_broadcast_last != 0 ? 1 : 0);
+  uint8_t *delta_ref = _delta_refs + index * DELTA_REF_LEN(_msg_len);
+  const uint8_t *ref = delta_ref; // What the next message is encoded against
+  uint8_t ref_length = 0;
+  uint8_t encoded[MSG_LEN_LIMIT];
+  bool delta = false;
+  bool undecodable = false;
+  uint16_t decoded = 0; // Message bytes once decoded
+
+  if (space == 0)
+  {
+    return 0;
+  }
+  if (state->replay)
+  { // An earlier replay failed, finish it before reading anything
+    if (!replayBroadcasts(client))
+    {
+      return -1;
+    }
+    state->replay = false;
+  }
+  int reply = sendPacket(_wire, client, batch ? READ_BATCH : READ, ack,
+                         batch ? request : request + 1, request_length)
+                  ? requestReply(client)
+                  : -1;
+  if (reply < 0)
+  {
+    STAT(_stats.bus_errors++);
+    return -1;
+  }
+
+  uint8_t header = (uint8_t)reply;
+  uint8_t length = header & REPLY_LENGTH_MASK;
+  uint8_t checksum = checkUpdate(CHECK_INIT, header);
+  if (header == (uint8_t)NAK)
+  {
+    STAT(_stats.check_failures++);
+    return -1; // The client did not get our READ
+  }
+  if (header == (uint8_t)BUSY)
+  {
+    return -2; // The client is still parsing, try again next time
+  }
+  if (header == (uint8_t)MISSED)
+  {
+    state->replay = !replayBroadcasts(client);
+    return state->replay ? -1 : 0;
+  }
+  if (length == 0)
+  {
+    return 0;
+  }
+  if (length > max_length)
+  {
+    STAT(_stats.check_failures++);
+    return -1;
+  }
+  TRACE_START(trace_start);
+  uint8_t received = _wire.requestFrom((int)client, length + 2);
+  TRACE_EVENT(TRACE_REQUEST, client, length + 2, received, trace_start, false);
+  if (received != length + 2)
+  {
+    STAT(_stats.bus_errors++);
+    return -1;
+  }
+
+  uint8_t first = _wire.read();
+  checksum = checkUpdate(checksum, first);
+  if (state->rx_synced && first == state->rx_next)
+  {
+    ref_length = state->delta_length;
+  }
+  if (!batch)
+  {
+    message = replyRecord(state, first, &records);
+    if (message == NULL)
+    {
+      return -1;
+    }
+    message->length = length;
+    message_left = length;
+    messages = 1;
+    delta = (header & REPLY_DELTA) != 0;
+  }
+  for (uint8_t idx = 0; idx < length; idx++)
+  {
+    uint8_t rc = _wire.read();
+    checksum = checkUpdate(checksum, rc);
+    if (message_left == 0)
+    { // Length of the next message in a READ_BATCH reply
+      uint8_t size = rc & ~MESSAGE_DELTA;
+      message = NULL;
+      if (size != 0 && size <= _msg_len && size <= length - idx - 1)
+      {
+        message = replyRecord(state, first + messages, &records);
+      }
+      if (message == NULL)
+      { // Malformed, or more messages than the room we offered
+        STAT(_stats.check_failures++);
+        return -1;
+      }
+      message->length = size;
+      message_left = size;
+      messages++;
+      delta = (rc & MESSAGE_DELTA) != 0;
+      continue;
+    }
+    (delta ? encoded : message->data)[message->length - message_left] = rc;
+    message_left--;
+    if (message_left > 0)
+    {
+      continue;
+    }
+    if (delta)
+    { // Decodes in place if both are _scratch, see deltaDecode
+      uint8_t size = (ref_length > 0)
+                         ? deltaDecode(encoded, message->length, ref, ref_length,
+                                       message->data, _msg_len)
+                         : 0;
+      undecodable = undecodable || size == 0;
+      message->length = size;
+    }
+    decoded += message->length;
+    ref = message->data;
+    ref_length = message->length;
+  }
+  if (message_left != 0 || checksum != (uint8_t)_wire.read())
+  {
+    STAT(_stats.check_failures++);
+    return -1;
+  }
+  if (undecodable)
+  {
+    STAT(_stats.check_failures++);
+    resyncClient(index);
+    return -1;
+  }
+  for (uint8_t i = 0; i < records; i++)
+  {
+    ((swireMessage_t *)messageQueueReserveAt(&_in_messages, i))->address = client;
+  }
+  messageQueueCommitN(&_in_messages, records);
+  state->rx_next = first + messages;
+  state->rx_synced = true;
+#if ENABLE_COMPRESSION
+  memcpy(delta_ref, message->data, message->length);
+  state->delta_length = message->length;
+#endif
+
+#if ENABLE_STATS
+  // READ packet, then address + LENGTH, then address + SEQ + DATA + CHECK
+  uint8_t payload = batch ? length - messages : length;
+  _stats.messages += records;
+  _stats.frames++;
+  _stats.payload_bytes += payload;
+  _stats.overhead_bytes += 1 + PACKET_OVERHEAD + request_length + 2 + 1 + 1 + length + 1 - payload;
+  _stats.delta_saved += decoded - payload;
+#endif
+  if (header & REPLY_URGENT)
+  {
+    return 3;
+  }
+  return (header & REPLY_MORE) ? 2 : 1;
+}
+
+
+// The Wire callbacks take no argument, so each client slot gets its own
+// pair. Slots past MAX_CLIENT_INSTANCES are never handed out.
+template <uint8_t N>
+void SWireClientBase::receiveTrampoline(int howMany)
+{
+  if (N < MAX_CLIENT_INSTANCES)
+  {
+    _client_instances[N]->receiveEvent(howMany);
+  }
+}
+
+template <uint8_t N>
+void SWireClientBase::requestTrampoline()
+{
+  if (N < MAX_CLIENT_INSTANCES)
+  {
+    _client_instances[N]->requestEvent();
+  }
+}
+
+#if MAX_CLIENT_INSTANCES > 4
+#error "MAX_CLIENT_INSTANCES can be at most 4"
+#endif
+static void (*const _receive_trampolines[4])(int) = {
+    SWireClientBase::receiveTrampoline<0>, SWireClientBase::receiveTrampoline<1>,
+    SWireClientBase::receiveTrampoline<2>, SWireClientBase::receiveTrampoline<3>};
+static void (*const _request_trampolines[4])() = {
+    SWireClientBase::requestTrampoline<0>, SWireClientBase::requestTrampoline<1>,
+    SWireClientBase::requestTrampoline<2>, SWireClientBase::requestTrampoline<3>};
+
+/** @brief Creates a new SWireClient object
+ *
+ *  Each client takes one of MAX_CLIENT_INSTANCES slots. A client created
+ *  when every slot is taken never joins the bus.
+ *
+ *  Called by SWireClientT, which owns the storage.
+ *
+ *  @param client_number  The client's address on the bus
+ *  @param wire           The bus to join, Wire unless the board has several
+ *  @param msg_len        The longest message the queues can hold
+ *  @param in_storage     Storage for depth message records
+ *  @param out_storage    Storage for depth message records
+ *  @param depth          The capacity of each queue, a power of two
+ *  @param urgent_storage Storage for urgent_depth message records for each
+ *                        priority above PRIORITY_NORMAL
+ *  @param urgent_depth   The capacity of each of those queues, a power of two
+ *  @return A new initialized SWireClient object
+ */
+SWireClientBase::SWireClientBase(uint8_t client_number, TwoWire &wire, uint8_t msg_len,
+                                 uint8_t *in_storage, uint8_t *out_storage, uint8_t depth,
+                                 uint8_t *urgent_storage, uint8_t urgent_depth)
+    : _wire(wire)
+{
+  _client_number = client_number;
+  _msg_len = msg_len;
+  _answer = NO_DATA;
+#if ENABLE_STATS
+  resetStats();
+#endif
+  _reply_pending = false;
+  _reply_staged = false;
+  _reply_length = 0;
+  _reply_count = 0;
+  _out_seq = 0;
+  _out_sent = 0;
+  _rx_seq = 0;
+  _rx_synced = false;
+#if ENABLE_COMPRESSION
+  _delta_enabled = false;
+  _delta_active = false;
+  _delta_ref_length = 0;
+#endif
+  _groups = 1 << BROADCAST_ALL;
+  _broadcast_seq = 0;
+  _broadcast_synced = false;
+  _broadcast_missed = false;
+  _broadcast_known = 0;
+  _stream_sink = NULL;
+  _stream_size = 0;
+  _stream_length = 0;
+  _stream_received = 0;
+  _stream_next = 0;
+  _stream_open = false;
+  _asleep = false;
+  _waking = false;
+  _woke_us = 0;
+  _before_sleep = NULL;
+  _after_wake = NULL;
+  _attention_pin = NO_ATTENTION_PIN;
+  _attention_asserted = false;
+  _handler.handler = NULL;
+  _handler.context = NULL;
+  _dispatch_table = NULL;
+  _dispatch_count = 0;
+  _dispatch_context = NULL;
+  packetReaderInit(&_reader, msg_len);
+#if CLIENT_DEFERRED_RX
+  messageQueueInit(&_rx_bytes, (char *)_rx_bytes_storage, RX_BUFFER_SIZE, 1);
+#endif
+  messageQueueInit(&_in_messages, (char *)in_storage, depth, MESSAGE_RECORD_LEN(msg_len));
+  messageQueueInit(&_out_messages[PRIORITY_NORMAL], (char *)out_storage, depth,
+                   MESSAGE_RECORD_LEN(msg_len));
+  for (uint8_t lane = 1; lane < PRIORITY_LEVELS; lane++)
+  {
+    messageQueueInit(&_out_messages[lane], (char *)urgent_storage, urgent_depth,
+                     MESSAGE_RECORD_LEN(msg_len));
+    urgent_storage += urgent_depth * MESSAGE_RECORD_LEN(msg_len);
+  }
+
+  for (uint8_t i = 0; i < MAX_CLIENT_INSTANCES; i++)
+  {
+    if (_client_instances[i] == NULL)
+    {
+      _client_instances[i] = this;
+      _wire.begin(client_number);
+#if defined(TWAR) && defined(TWGCE)
+      TWAR |= _BV(TWGCE); // Answer general calls too, for broadcasts
+#endif
+      _wire.onReceive(_receive_trampolines[i]);
+      _wire.onRequest(_request_trampolines[i]);
+      break;
+    }
+  }
+}
+
+/** @brief Takes the bytes written by the master, from the Wire receive ISR
+ *
+ *  With CLIENT_DEFERRED_RX the bytes are only copied to _rx_bytes for
+ *  service to parse. A byte that does not fit is dropped, which makes its
+ *  packet fail its CHECK.
+ */
+void SWireClientBase::receiveEvent(int howMany)
+{
+  (void)howMany; // Only traced
+  TRACE_START(trace_start);
+  wakeUp(false);
+#if CLIENT_DEFERRED_RX
+  while (_wire.available() > 0)
+  {
+    char *slot = messageQueueReserve(&_rx_bytes);
+    uint8_t rc = _wire.read();
+    if (slot != NULL)
+    {
+      *slot = (char)rc;
+      messageQueueCommit(&_rx_bytes);
+    }
+  }
+  TRACE_EVENT(TRACE_RECEIVE_ISR, _client_number, howMany, 0, trace_start, true);
+#else
+  char command = NO_DATA;
+  uint8_t seq = 0;
+  uint8_t count = 0;
+
+  int result = readPacket(_wire, &_reader, &_in_messages, &command, &seq, &count);
+  if (result != 0)
+  {
+    handlePacket(result, command, seq, count);
+  }
+  TRACE_EVENT(TRACE_RECEIVE_ISR, _client_number, howMany, result, trace_start, true);
+#endif
+}
+
+/** @brief parses the bytes receiveEvent buffered and hands messages to
+ *         their handlers
+ *
+ *  Only needed with CLIENT_DEFERRED_RX or onMessage, otherwise this does
+ *  nothing. Until it runs, a CLIENT_DEFERRED_RX client answers the master
+ *  with BUSY, so call it from loop() as often as possible.
+ */
+void SWireClientBase::service()
+{
+#if CLIENT_DEFERRED_RX
+  char *rc;
+  // Each byte stays queued until it has been handled, which keeps
+  // requestEvent answering BUSY and out of the queues meanwhile
+  while ((rc = messageQueuePeek(&_rx_bytes)) != NULL)
+  {
+    char command = NO_DATA;
+    uint8_t seq = 0;
+    uint8_t count = 0;
+    int result = packetReaderFeed(&_reader, &_in_messages, (uint8_t)*rc, &command, &seq, &count);
+    if (result != 0)
+    {
+      handlePacket(result, command, seq, count);
+    }
+    messageQueuePop(&_rx_bytes);
+  }
+#endif
+  dispatchMessages();
+}
+
+/** @brief hands received messages over to their handlers, oldest first */
+void SWireClientBase::dispatchMessages()
+{
+  swireMessage_t *message;
+  while ((message = (swireMessage_t *)messageQueuePeek(&_in_messages)) != NULL &&
+         dispatchMessage(message, _dispatch_table, _dispatch_count, _dispatch_context, &_handler))
+  {
+    messageQueuePop(&_in_messages);
+  }
+}
+
+/** @brief sets the handler for messages from the master
+ *
+ *  service hands each message to the handler, in place, and drops it once
+ *  the handler returns. Messages go out in the order they were received;
+ *  one that no handler takes is left for getData, and holds the ones behind
+ *  it until it is taken. The handler runs from the main loop, not an ISR,
+ *  and may send data but must not take any with getData or peekData.
+ *
+ *  @param handler  The handler, NULL to leave messages to getData
+ *  @param context  Passed to handler unchanged
+ *  @return A status code indicating success or failure
+ */
+int SWireClientBase::onMessage(swireMessageHandler_t handler, void *context)
+{
+  _handler.handler = handler;
+  _handler.context = context;
+  return 1;
+}
+
+/** @brief sets handlers picked by the first byte of each message
+ *
+ *  An entry whose type matches a message's first byte takes it ahead of the
+ *  onMessage handler. The table is searched in order and must stay valid
+ *  while it is set, a static const array being the usual choice.
+ *
+ *  @param table    The table, NULL for none
+ *  @param count    The number of entries in table
+ *  @param context  Passed to the table's handlers unchanged
+ */
+void SWireClientBase::setDispatchTable(const swireDispatchEntry_t *table, uint8_t count,
+                                       void *context)
+{
+  _dispatch_table = table;
+  _dispatch_count = (table != NULL) ? count : 0;
+  _dispatch_context = context;
+}
+
+/** @brief acts on a packet read by readPacket or packetReaderFeed
+ *
+ *  @param result   The reader's status code for the packet
+ *  @param command  The packet's COMMAND
+ *  @param seq      The packet's SEQ
+ *  @param count    The number of queue records the packet filled
+ */
+void SWireClientBase::handlePacket(int result, char command, uint8_t seq, uint8_t count)
+{
+  _reply_pending = false; // Any reply the master didn't collect is abandoned
+  _reply_staged = false;
+  if (result < 0)
+  {
+    STAT(_stats.check_failures++);
+    _answer = NAK; // Have the master send it again
+    return;
+  }
+  // Nobody reads the answer to a general call, and one left waiting would
+  // keep the client awake until the next poll
+  _answer = (command == BROADCAST) ? NO_DATA : ACK;
+
+  if (command == BROADCAST || command == REPLAY)
+  {
+    handleBroadcast(result, command, seq, count);
+    updateAttention(); // Asserted if this showed a broadcast was missed
+  }
+  else if (command == STREAM_OPEN || command == STREAM)
+  {
+    handleStream(command, seq);
+  }
+  else if (command == WRITE || command == BATCH)
+  {
+    if (_rx_synced && seq == _rx_seq)
+    {
+      STAT(_stats.duplicates++);
+      return; // Retransmission of a packet we already have, ACK it again
+    }
+    if (result == 2)
+    {
+      STAT(_stats.queue_full++);
+      _answer = NAK; // Nothing is kept, so the master can resend it all
+      return;
+    }
+    messageQueueCommitN(&_in_messages, count);
+    STAT(_stats.messages += count);
+    STAT(_stats.frames++);
+    _rx_seq = seq;
+    _rx_synced = true;
+  }
+  else if (command == READ || command == READ_BATCH)
+  {
+    // Drop the messages the master has acknowledged
+    uint8_t acked = (uint8_t)(seq - _out_seq);
+    if (acked <= _out_sent)
+    {
+      for (uint8_t i = 0; i < acked; i++)
+      {
+#if ENABLE_COMPRESSION
+        if (i == acked - 1)
+        { // The reference for the next reply
+          swireMessage_t *last = (swireMessage_t *)messageQueuePeek(&_out_messages[_sent_lanes[i]]);
+          memcpy(_delta_ref, last->data, last->length);
+          _delta_ref_length = last->length;
+        }
+#endif
+        messageQueuePop(&_out_messages[_sent_lanes[i]]);
+      }
+      memmove(_sent_lanes, _sent_lanes + acked, _out_sent - acked);
+      _out_seq = _out_seq + acked;
+      _out_sent = _out_sent - acked;
+    }
+    uint8_t latest = (command == READ_BATCH) ? 1 : 0; // Where the broadcast SEQ is
+    if (_reader.scratch.length > latest &&
+        (!_broadcast_synced || _reader.scratch.data[latest] != _broadcast_seq))
+    { // The master replays what we missed, which leaves us up to date
+      _broadcast_seq = _reader.scratch.data[latest];
+      _broadcast_synced = true;
+      _broadcast_missed = false;
+      _answer = MISSED;
+    }
+    else if (command == READ_BATCH)
+    {
+      stageReply(true, (_reader.scratch.length > 0) ? _reader.scratch.data[0] : 1);
+    }
+    else
+    {
+      stageReply(false, 1);
+    }
+    updateAttention(); // Released once everything sent has been acknowledged
+  }
+  else if (command == PING)
+  {
+    // A (re)started master knows nothing of what was sent before
+    _rx_synced = false;
+    _out_sent = 0;
+    _broadcast_synced = false;
+    _broadcast_known = 0;
+#if ENABLE_COMPRESSION
+    _delta_active = _delta_enabled && _reader.scratch.length > 0 &&
+                    (_reader.scratch.data[0] & PING_DELTA);
+    _delta_ref_length = 0;
+    _answer = _delta_active ? ACK_DELTA : ACK;
+#endif
+  }
+}
+
+/** @brief takes a BROADCAST or REPLAY for handlePacket
+ *
+ *  Its message is kept if the client is in the target group and has not
+ *  taken that broadcast yet. A BROADCAST whose SEQ is not the one after the
+ *  last broadcast seen means one was lost; so does one there was no room
+ *  for, since nobody would hear a NAK. Unless it is a REPLAY, which is
+ *  answered like a WRITE.
+ *
+ *  @param result   The reader's status code for the packet
+ *  @param command  BROADCAST or REPLAY
+ *  @param seq      The packet's SEQ
+ *  @param count    The number of queue records the packet filled
+ */
+void SWireClientBase::handleBroadcast(int result, char command, uint8_t seq, uint8_t count)
+{
+  uint8_t group = _reader.address;
+  bool wanted = group <= MAX_GROUPS && (_groups & (1 << group)) &&
+                !((_broadcast_known & (1 << group)) && _broadcast_taken[group] == seq);
+
+  if (command == BROADCAST)
+  {
+    if (_broadcast_synced && seq != nextBroadcastSeq(_broadcast_seq))
+    {
+      _broadcast_synced = false;
+      _broadcast_missed = true;
+    }
+    _broadcast_seq = seq;
+  }
+  if (!wanted)
+  {
+    if (command == REPLAY)
+    {
+      STAT(_stats.duplicates++);
+    }
+    return;
+  }
+  if (result == 2)
+  {
+    STAT(_stats.queue_full++);
+    if (command == REPLAY)
+    {
+      _answer = NAK;
+    }
+    else
+    {
+      _broadcast_synced = false;
+      _broadcast_missed = true;
+    }
+    return;
+  }
+  messageQueueCommitN(&_in_messages, count);
+  STAT(_stats.messages += count);
+  STAT(_stats.frames++);
+  _broadcast_taken[group] = seq;
+  _broadcast_known |= 1 << group;
+}
+
+/** @brief takes a STREAM_OPEN or STREAM for handlePacket
+ *
+ *  A frame is only passed on if it is the one expected next, with the
+ *  length expected, and the sink takes it. Every STREAM is answered with
+ *  the SEQ expected next, which acknowledges every frame before it.
+ *
+ *  @param command  STREAM_OPEN or STREAM
+ *  @param seq      The packet's SEQ
+ */
+void SWireClientBase::handleStream(char command, uint8_t seq)
+{
+  swireMessage_t *frame = &_reader.scratch;
+  if (command == STREAM_OPEN)
+  {
+    uint32_t length = 0;
+    for (uint8_t i = 0; i < 4 && i < frame->length; i++)
+    {
+      length |= (uint32_t)frame->data[i] << (8 * i);
+    }
+    if (_stream_sink == NULL || frame->length != 4 || length > _stream_size)
+    {
+      _answer = NAK;
+      return;
+    }
+    _stream_length = length;
+    _stream_received = 0;
+    _stream_next = 0;
+    _stream_open = (length > 0);
+    return;
+  }
+
+  uint32_t left = _stream_length - _stream_received;
+  if (_stream_open && seq == _stream_next && frame->length > 0 &&
+      frame->length == ((left < STREAM_CHUNK) ? left : STREAM_CHUNK) &&
+      _stream_sink(_stream_received, frame->data, frame->length, _stream_context))
+  {
+    STAT(_stats.frames++);
+    STAT(_stats.payload_bytes += frame->length);
+    _stream_received = _stream_received + frame->length;
+    _stream_next = _stream_next + 1;
+    _stream_open = (_stream_received < _stream_length);
+  }
+  _answer = _stream_next & 0x7F;
+}
+
+/** @brief Pulls the attention line low while any message is queued, or
+ *         after a broadcast was missed
+ *
+ *  The line is open-drain: it is only ever driven low, and let go by
+ *  turning the pin back into an input. The pin is only touched when the
+ *  state changes.
+ */
+void SWireClientBase::updateAttention()
+{
+  if (_attention_pin == NO_ATTENTION_PIN)
+  {
+    return;
+  }
+  bool pending = _broadcast_missed;
+  for (uint8_t lane = 0; lane < PRIORITY_LEVELS; lane++)
+  {
+    pending = pending || !messageQueueIsEmpty(&_out_messages[lane]);
+  }
+  if (pending == _attention_asserted)
+  {
+    return;
+  }
+  if (pending)
+  {
+    digitalWrite(_attention_pin, LOW);
+    pinMode(_attention_pin, OUTPUT);
+  }
+  else
+  {
+    pinMode(_attention_pin, INPUT);
+  }
+  _attention_asserted = pending;
+}
+
+/** @brief Builds the reply to a READ or READ_BATCH in _reply
+ *
+ *  A READ gets a single message, a READ_BATCH as many whole messages as the
+ *  master has room for. Every reply starts with the messages already sent
+ *  but not acknowledged, in the order they were first sent, so anything the
+ *  master missed goes again under the same sequence numbers. New messages
+ *  follow, highest priority first. The LENGTH goes in _answer and the rest
+ *  (SEQ, DATA and CHECK) in _reply, so that requestEvent only has to hand
+ *  bytes to Wire. The messages stay queued until the master acknowledges
+ *  them.
+ *
+ *  With delta encoding on, each message is encoded against the one before
+ *  it, the first against _delta_ref, and sent as it is whenever that isn't
+ *  shorter.
+ *
+ *  @param batch  Whether the reply is for a READ_BATCH
+ *  @param limit  The most messages the master can take
+ */
+void SWireClientBase::stageReply(bool batch, uint8_t limit)
+{
+  swireMessage_t *messages[MAX_REPLY_MESSAGES] = {NULL};
+  uint8_t ends[MAX_REPLY_MESSAGES]; // Where each message ends in _reply
+  uint8_t taken[PRIORITY_LEVELS] = {0}; // Messages in the reply per lane
+  uint8_t max_length = batch ? MAX_BATCH_LEN : _msg_len;
+  uint8_t count = 0;
+  uint8_t total = 0;
+  uint8_t header;
+  bool delta = false; // Whether the message of a READ reply is delta encoded
+#if ENABLE_COMPRESSION
+  const uint8_t *ref = _delta_ref;
+  uint8_t ref_length = _delta_active ? _delta_ref_length : 0;
+  uint8_t encoded[MSG_LEN_LIMIT];
+#endif
+
+  if (limit > MAX_REPLY_MESSAGES)
+  {
+    limit = MAX_REPLY_MESSAGES;
+  }
+  // Resent messages keep their place, new ones fill in _sent_lanes after them
+  int8_t lane = PRIORITY_LEVELS - 1;
+  while (count < limit)
+  {
+    if (count < _out_sent)
+    {
+      lane = _sent_lanes[count];
+    }
+    else
+    {
+      while (lane >= 0 && taken[lane] >= messageQueueCount(&_out_messages[lane]))
+      {
+        lane--;
+      }
+      if (lane < 0)
+      {
+        break;
+      }
+    }
+    swireMessage_t *message =
+        (swireMessage_t *)messageQueuePeekAt(&_out_messages[lane], taken[lane]);
+    const uint8_t *data = message->data;
+    uint8_t size = message->length;
+    delta = false;
+#if ENABLE_COMPRESSION
+    uint8_t encoded_length =
+        (ref_length > 0)
+            ? deltaEncode(message->data, message->length, ref, ref_length, encoded, size - 1)
+            : 0;
+    if (encoded_length > 0)
+    {
+      data = encoded;
+      size = encoded_length;
+      delta = true;
+    }
+    if (_delta_active)
+    {
+      ref = message->data;
+      ref_length = message->length;
+    }
+#endif
+    if (total + (batch ? 1 : 0) + size > max_length)
+    {
+      break;
+    }
+    if (batch)
+    {
+      _reply[1 + total++] = size | (delta ? MESSAGE_DELTA : 0);
+    }
+    memcpy(_reply + 1 + total, data, size);
+    total += size;
+    ends[count] = total;
+    messages[count] = message;
+    _sent_lanes[count] = lane;
+    taken[lane]++;
+    count++;
+    if (count >= _out_sent)
+    {
+      lane = PRIORITY_LEVELS - 1; // Back to the top for the new messages
+    }
+  }
+
+  for (;;)
+  {
+    bool more = false;
+    bool urgent = false;
+    for (uint8_t p = 0; p < PRIORITY_LEVELS; p++)
+    {
+      if (messageQueueCount(&_out_messages[p]) > taken[p])
+      {
+        more = true;
+        urgent = urgent || p > PRIORITY_NORMAL;
+      }
+    }
+    header = total | (more ? REPLY_MORE : 0) | (urgent ? REPLY_URGENT : 0) |
+             ((!batch && count > 0 && delta) ? REPLY_DELTA : 0);
+    if (header != (uint8_t)NAK && header != (uint8_t)BUSY && header != (uint8_t)MISSED)
+    {
+      break;
+    }
+    if (!batch && count > 0 && delta)
+    { // Would read as a control character, send the message as it is
+      delta = false;
+      total = messages[0]->length;
+      memcpy(_reply + 1, messages[0]->data, total);
+      continue;
+    }
+    // Would read as a NAK, send one message less instead
+    count--;
+    total = (count > 0) ? ends[count - 1] : 0;
+    taken[_sent_lanes[count]]--;
+  }
+
+  uint8_t checksum = checkUpdate(CHECK_INIT, header);
+  uint8_t length = 1 + total;
+  _reply[0] = _out_seq;
+  for (uint8_t i = 0; i < length; i++)
+  {
+    checksum = checkUpdate(checksum, _reply[i]);
+  }
+  _reply[length++] = checksum;
+
+  _reply_length = length;
+  _reply_count = count;
+  _reply_staged = (count > 0);
+  _answer = header;
+}
+
+/** @brief Answers the master's read, from the Wire request ISR
+ *
+ *  Everything was prepared by handlePacket, so this only writes it out.
+ */
+void SWireClientBase::requestEvent()
+{
+  TRACE_START(trace_start);
+  wakeUp(true);
+#if CLIENT_DEFERRED_RX
+  if (!messageQueueIsEmpty(&_rx_bytes))
+  {
+    _wire.write(BUSY); // service hasn't caught up with the last packet yet
+    TRACE_EVENT(TRACE_REQUEST_ISR, _client_number, 1, -1, trace_start, true);
+    return;
+  }
+#endif
+  if (_reply_pending)
+  {
+    _wire.write(_reply, _reply_length);
+    _reply_pending = false;
+    TRACE_EVENT(TRACE_REQUEST_ISR, _client_number, _reply_length, 1, trace_start, true);
+    STAT(_stats.frames++);
+    if (_reply_count > _out_sent)
+    {
+      STAT(_stats.retries += _out_sent);
+      STAT(_stats.messages += _reply_count - _out_sent);
+      _out_sent = _reply_count;
+    }
+    else
+    {
+      STAT(_stats.retries += _reply_count);
+    }
+    return;
+  }
+
+  _wire.write(_answer);
+  _answer = NO_DATA;
+  _reply_pending = _reply_staged; // The rest of the reply is due next
+  _reply_staged = false;
+  TRACE_EVENT(TRACE_REQUEST_ISR, _client_number, 1, 0, trace_start, true);
+}
+
+/** @brief times the first exchange after sleep, from the Wire ISRs
+ *
+ *  The clock is stopped while the MCU sleeps, so the time starts at the
+ *  first interrupt after it and ends when the master is answered.
+ *
+ *  @param answering  Whether the master is being answered
+ */
+void SWireClientBase::wakeUp(bool answering)
+{
+  if (_asleep)
+  {
+    _asleep = false;
+    _woke_us = micros();
+    _waking = true;
+  }
+  if (answering && _waking)
+  {
+    _waking = false;
+#if ENABLE_STATS
+    addLatencySample(&_stats, micros() - _woke_us);
+#endif
+  }
+}
+
+/** @brief drives a shared attention line while there is data to send
+ *
+ *  The line is pulled low while any message is queued and released once
+ *  the master has acknowledged them all. It must be wired to every client
+ *  and to the pin given to the master's setAttentionPin.
+ *
+ *  @param pin  The pin the line is wired to, NO_ATTENTION_PIN for none
+ */
+void SWireClientBase::setAttentionPin(uint8_t pin)
+{
+  noInterrupts();
+  if (_attention_asserted)
+  {
+    pinMode(_attention_pin, INPUT);
+    _attention_asserted = false;
+  }
+  _attention_pin = pin;
+  updateAttention();
+  interrupts();
+}
+
+/** @brief starts taking the broadcasts to a group
+ *
+ *  The group's latest broadcast is replayed to the client when it is next
+ *  polled.
+ *
+ *  @param group  The group to join, from 1 to MAX_GROUPS
+ *  @return A status code indicating success or failure
+ */
+int SWireClientBase::joinGroup(uint8_t group)
+{
+  if (group == BROADCAST_ALL || group > MAX_GROUPS)
+  {
+    return 0;
+  }
+  noInterrupts();
+  _groups |= 1 << group;
+  _broadcast_synced = false; // Answer MISSED to fetch the group's latest
+  _broadcast_missed = true;
+  updateAttention();
+  interrupts();
+  return 1;
+}
+
+/** @brief stops taking the broadcasts to a group
+ *
+ *  @param group  The group to leave, from 1 to MAX_GROUPS
+ *  @return A status code indicating success or failure
+ */
+int SWireClientBase::leaveGroup(uint8_t group)
+{
+  if (group == BROADCAST_ALL || group > MAX_GROUPS)
+  {
+    return 0;
+  }
+  noInterrupts();
+  _groups &= ~(1 << group);
+  _broadcast_known &= ~(1 << group); // Take it afresh if joined again
+  interrupts();
+  return 1;
+}
+
+/** @brief Writes a stream into memory, for receiveStream */
+static bool memorySink(uint32_t offset, const uint8_t *data, uint8_t length, void *context)
+{
+  memcpy((uint8_t *)context + offset, data, length);
+  return true;
+}
+
+/** @brief takes the streams the master sends into a buffer
+ *
+ *  Each stream is written from the start of buffer, over the last one. A
+ *  stream longer than size is refused.
+ *
+ *  @param buffer  The buffer to write streams to
+ *  @param size    The size of buffer in bytes
+ *  @return A status code indicating success or failure
+ */
+int SWireClientBase::receiveStream(uint8_t *buffer, uint32_t size)
+{
+  noInterrupts();
+  _stream_sink = (buffer != NULL) ? memorySink : NULL;
+  _stream_context = buffer;
+  _stream_size = size;
+  _stream_open = false;
+  interrupts();
+  return buffer != NULL;
+}
+
+/** @brief takes the streams the master sends through a callback
+ *
+ *  sink is handed each piece of a stream in order, from the receive ISR,
+ *  or from service with CLIENT_DEFERRED_RX, so it should be quick. If it
+ *  can't take a piece yet it returns false and the master sends it again.
+ *
+ *  @param sink     The callback taking the streams, NULL to refuse them
+ *  @param context  Passed to sink unchanged
+ *  @return A status code indicating success or failure
+ */
+int SWireClientBase::receiveStream(swireStreamSink_t sink, void *context)
+{
+  noInterrupts();
+  _stream_sink = sink;
+  _stream_context = context;
+  _stream_size = 0xFFFFFFFF;
+  _stream_open = false;
+  interrupts();
+  return sink != NULL;
+}
+
+/** @brief tells how the stream being received is getting on
+ *
+ *  @param received  Set to the number of bytes received so far, may be NULL
+ *  @param length    Set to the length of the stream, may be NULL
+ *  @return 1 while a stream is being received, 0 when all of the last one
+ *          was, or none was started
+ */
+int SWireClientBase::streamStatus(uint32_t *received, uint32_t *length)
+{
+  noInterrupts(); // Not read in one go on 8-bit cores
+  if (received != NULL)
+  {
+    *received = _stream_received;
+  }
+  if (length != NULL)
+  {
+    *length = _stream_length;
+  }
+  bool open = _stream_open;
+  interrupts();
+  return open;
+}
+
+/** @brief sleeps until the master next addresses the client
+ *
+ *  Puts the MCU in CLIENT_SLEEP_MODE, the deepest mode a TWI address match
+ *  still wakes it from, unless there are received messages to be taken
+ *  with getData or service, an answer the master has yet to read or, with
+ *  CLIENT_DEFERRED_RX, bytes for service to parse. Call it at the end of loop() once those have been dealt with. Any other
+ *  enabled interrupt, such as a watchdog or pin change, wakes the MCU as
+ *  well.
+ *
+ *  millis and micros stop while asleep. The oscillator's start up time is
+ *  not seen by the client either: the TWI holds the bus clock low until
+ *  the MCU is running, so it adds to the master's transaction, and must be
+ *  well within the master's Wire timeout. The first exchange after waking
+ *  is timed into the client's latency counters, and the hooks set with
+ *  setSleepHooks can time the rest, by toggling a pin for instance.
+ *
+ *  @return 1 once the client has slept and woken up again, 0 if it had
+ *          work to do or the core can't sleep
+ */
+int SWireClientBase::sleep()
+{
+#if CLIENT_CAN_SLEEP
+  if (!canSleep())
+  {
+    return 0;
+  }
+  if (_before_sleep != NULL)
+  {
+    _before_sleep();
+  }
+  set_sleep_mode(CLIENT_SLEEP_MODE);
+  noInterrupts();
+  // Checked again with interrupts off, so a packet that arrived since
+  // isn't left waiting for the next wake up
+  bool idle = canSleep();
+  if (idle)
+  {
+    sleep_enable();
+    _asleep = true;
+    interrupts(); // The instruction after this one runs before any interrupt
+    sleep_cpu();
+    sleep_disable();
+    STAT(_stats.sleeps++);
+  }
+  interrupts();
+  if (_after_wake != NULL)
+  {
+    _after_wake();
+  }
+  return idle;
+#else
+  return 0;
+#endif
+}
+
+/** @brief tells whether there is nothing for the client to do until the
+ *  master next writes to it
+ */
+bool SWireClientBase::canSleep()
+{
+  if (!messageQueueIsEmpty(&_in_messages) || _answer != (uint8_t)NO_DATA || _reply_pending ||
+      _reply_staged)
+  {
+    return false; // The master reads the answer straight after its write
+  }
+#if CLIENT_DEFERRED_RX
+  return messageQueueIsEmpty(&_rx_bytes);
+#else
+  return true;
+#endif
+}
+
+/** @brief sets functions to call around each sleep
+ *
+ *  before_sleep can turn off peripherals the client doesn't need while
+ *  asleep, and after_wake turn them back on. Both are called from the main
+ *  loop, not an ISR.
+ *
+ *  @param before_sleep  Called just before the MCU sleeps, may be NULL
+ *  @param after_wake    Called once it has woken up, may be NULL
+ */
+void SWireClientBase::setSleepHooks(void (*before_sleep)(), void (*after_wake)())
+{
+  _before_sleep = before_sleep;
+  _after_wake = after_wake;
+}
+
+/** @brief delta encodes the messages sent to the master
+ *
+ *  Each message goes as its difference to the one before it, with runs of
+ *  unchanged bytes collapsed, whenever that is shorter. This is agreed on
+ *  in the master's PING, so it must be enabled before identifyClients; it
+ *  can be turned off at any time. Does nothing if ENABLE_COMPRESSION is 0.
+ *
+ *  @param enable  Whether to delta encode
+ */
+void SWireClientBase::setCompression(bool enable)
+{
+#if ENABLE_COMPRESSION
+  noInterrupts();
+  _delta_enabled = enable;
+  _delta_active = _delta_active && enable;
+  interrupts();
+#else
+  (void)enable;
+#endif
+}
+
+/** @brief sends a data string to the master.
+ *
+ *  The string is sent without its null terminator.
+ *
+ *  @param data     The null terminated string to write to the master
+ *  @param priority The lane to queue it in, PRIORITY_NORMAL by default
+ *  @return A status code indicating success or failure
+ */
+int SWireClientBase::sendData(char *data, uint8_t priority)
+{
+  return sendData((const uint8_t *)data, strlen(data), priority);
+}
+
+/** @brief sends binary data to the master.
+ *
+ *  Internally, this function enqueues the data to be written when convenient.
+ *  Messages of a higher priority are sent before any of a lower one, even
+ *  those queued earlier. This function fails when the data is empty or
+ *  longer than MsgLen, when priority is not below PRIORITY_LEVELS, or when
+ *  the priority's queue is full.
+ *
+ *  @param data     The data to write to the master
+ *  @param length   The number of bytes in data
+ *  @param priority The lane to queue it in, PRIORITY_NORMAL by default
+ *  @return A status code indicating success or failure
+ */
+int SWireClientBase::sendData(const uint8_t *data, size_t length, uint8_t priority)
+{
+  if (length == 0 || length > _msg_len || priority >= PRIORITY_LEVELS)
+  {
+    return 0;
+  }
+  swireMessage_t *new_message = (swireMessage_t *)messageQueueReserve(&_out_messages[priority]);
+  if (new_message == NULL)
+  {
+#if ENABLE_STATS
+    noInterrupts(); // The receive ISR counts its own refusals in queue_full
+    _stats.queue_full++;
+    interrupts();
+#endif
+    return 0;
+  }
+  new_message->address = _client_number;
+  new_message->length = (uint8_t)length;
+  memcpy(new_message->data, data, length);
+  messageQueueCommit(&_out_messages[priority]);
+  if (!_attention_asserted && _attention_pin != NO_ATTENTION_PIN)
+  {
+    noInterrupts(); // The receive ISR may be releasing the line
+    updateAttention();
+    interrupts();
+  }
+  return 1;
+}
+
+/** @brief sends binary data to the master, replacing any queued value
+ *         with the same key.
+ *
+ *  The key is the first byte of data. If the priority's queue holds a
+ *  message with the same key that has not been sent to the master yet, it
+ *  is overwritten in place and keeps its place in the queue; otherwise the
+ *  data is queued as by sendData. Messages already sent, and waiting for
+ *  the master's acknowledgement, are left alone, so the master still gets
+ *  every key's latest value, just not the values in between.
+ *
+ *  This function fails as sendData does, but only when the queue is full of
+ *  other keys.
+ *
+ *  @param data     The data to write to the master
+ *  @param length   The number of bytes in data
+ *  @param priority The lane to queue it in, PRIORITY_NORMAL by default
+ *  @return A status code indicating success or failure
+ */
+int SWireClientBase::sendLatest(const uint8_t *data, size_t length, uint8_t priority)
+{
+  if (length == 0 || length > _msg_len || priority >= PRIORITY_LEVELS)
+  {
+    return 0;
+  }
+  messageQueue_t *queue = &_out_messages[priority];
+  noInterrupts(); // requestEvent must not stage or drop messages meanwhile
+  // Skip this lane's messages that were sent, or copied into a reply
+  uint8_t in_flight = _out_sent;
+  if ((_reply_staged || _reply_pending) && _reply_count > in_flight)
+  {
+    in_flight = _reply_count;
+  }
+  uint8_t first = 0;
+  for (uint8_t i = 0; i < in_flight; i++)
+  {
+    first += (_sent_lanes[i] == priority) ? 1 : 0;
+  }
+  for (uint8_t i = first; i < messageQueueCount(queue); i++)
+  {
+    swireMessage_t *message = (swireMessage_t *)messageQueuePeekAt(queue, i);
+    if (message->data[0] == data[0])
+    {
+      message->length = (uint8_t)length;
+      memcpy(message->data, data, length);
+      STAT(_stats.coalesced++);
+      interrupts();
+      return 1;
+    }
+  }
+  interrupts();
+  return sendData(data, length, priority);
+}
+
+/** @brief Retrieve data if there is any to get
+ *
+ *  @param buffer A string of at least MsgLen + 1 bytes to populate with
+ *                the possible data. The data is null terminated.
+ *  @return A status code indicating whether data was retrieved
+ */
+int SWireClientBase::getData(char *buffer)
+{
+  int length = getData((uint8_t *)buffer, _msg_len);
+  buffer[length] = '\0';
+  return length > 0;
+}
+
+/** @brief Retrieve binary data if there is any to get
+ *
+ *  Data beyond size bytes is discarded.
+ *
+ *  @param buffer A buffer to populate with the possible data
+ *  @param size   The size of buffer in bytes
+ *  @return The number of bytes copied into buffer, 0 if no data.
+ */
+int SWireClientBase::getData(uint8_t *buffer, size_t size)
+{
+  const uint8_t *data;
+  int length = peekData(&data);
+  if (length == 0)
+  {
+    return 0;
+  }
+  if ((size_t)length > size)
+  {
+    length = (int)size;
+  }
+  memcpy(buffer, data, length);
+  releaseData();
+  return length;
+}
+
+/** @brief Look at the oldest received message without copying it
+ *
+ *  The data stays valid until releaseData is called, the master can keep
+ *  adding messages behind it in the meantime.
+ *
+ *  @param data Set to point at the message's data, NULL if no data
+ *  @return The number of bytes at data, 0 if no data.
+ */
+int SWireClientBase::peekData(const uint8_t **data)
+{
+  swireMessage_t *message = (swireMessage_t *)messageQueuePeek(&_in_messages);
+  if (message == NULL)
+  {
+    *data = NULL;
+    return 0;
+  }
+  *data = message->data;
+  return message->length;
+}
+
+/** @brief Frees the message returned by peekData */
+void SWireClientBase::releaseData()
+{
+  messageQueuePop(&_in_messages);
+}
+
+/** @brief gets the most messages one of the client's queues has held
+ *
+ *  As SWireMaster::getQueueHighWater, for the queue of received messages
+ *  or one of the priority lanes of the sendData queue.
+ *
+ *  @param outgoing  Whether to ask about a sendData lane
+ *  @param priority  The lane, when outgoing
+ *  @return The most messages the queue has held at once, 0 for a priority
+ *          not below PRIORITY_LEVELS
+ */
+uint8_t SWireClientBase::getQueueHighWater(bool outgoing, uint8_t priority)
+{
+  if (!outgoing)
+  {
+    return messageQueueHighWater(&_in_messages);
+  }
+  return (priority < PRIORITY_LEVELS) ? messageQueueHighWater(&_out_messages[priority]) : 0;
+}
+
+#if ENABLE_STATS
+/** @brief gets the client's counters
+ *
+ *  The counters are updated from the Wire ISRs. On 8-bit cores, copy them
+ *  with interrupts disabled to be sure of a consistent snapshot.
+ *
+ *  @return A pointer to the counters, which stay valid for the lifetime of
+ *          the client
+ */
+const swireStats_t *SWireClientBase::getStats()
+{
+  return &_stats;
+}
+
+/** @brief zeroes the client's counters */
+void SWireClientBase::resetStats()
+{
+  noInterrupts();
+  memset(&_stats, 0, sizeof(_stats));
+  _stats.latency_min_us = 0xFFFFFFFF;
+  interrupts();
 }
+#endif
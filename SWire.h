@@ -6,55 +6,200 @@
  *  Clients are polled for data. 
  *
  *  The library is divided into Master and Client classes. In order for constant
- *  data flow, the master should call "getData" often. Functions
- *  in the SWire library do not block and all but getClients should be
- *  execute relatively quickly.
+ *  data flow, the master should call "getData" (or "service" if it only
+ *  sends) often. Data given to the master's sendData is queued and written
+ *  from service, one transaction per call. Functions in the SWire library
+ *  do not block and all but identifyClients should be execute relatively
+ *  quickly.
+ *  A client built with CLIENT_DEFERRED_RX, or given handlers with onMessage,
+ *  must call "service" from its loop as well. A battery powered client can end its loop with "sleep", which
+ *  powers the MCU down until the master next addresses it.
  *
- *  Currently, only bytes with values between 1 and 127 inclusive are allowed 
- *  to be sent via this protocol. Bytes above 127 will work, but could cause 
- *  errors if they are reserved bytes (see #define section below)
+ *  Where a spare GPIO can be wired to every device, setAttentionPin on the
+ *  master and the clients turns it into an open-drain "data ready" line,
+ *  and the master stops polling clients that have nothing to send.
+ *
+ *  broadcastData writes one message to every client, or to the clients that
+ *  joined a group, in a single I2C general call. Nobody acknowledges a
+ *  general call, so each READ afterwards tells the client which broadcast
+ *  was the latest, and a client that missed it answers MISSED and has the
+ *  latest broadcast to each target replayed to it. A client that misses
+ *  several broadcasts to the same target only gets the last of them, so
+ *  broadcasts suit state that supersedes itself (configuration, time,
+ *  mode changes) rather than streams. A broadcast must fit in every
+ *  client's MsgLen, and is not ordered against the sendData queue.
+ *  Clients enable general call reception on AVR. On cores whose Wire cannot,
+ *  a client still gets every broadcast, as a replay when it is next polled.
+ *
+ *  Data too long for one message, like a calibration table or a firmware
+ *  image, can be streamed to a client with beginStream. The master reads it
+ *  piece by piece from a callback, or from memory, and writes it a window
+ *  of frames at a time from service; the client hands it on to a callback,
+ *  or into a buffer, as it arrives. Neither end needs to hold all of it.
+ *
+ *  Every master and client keeps its own queues and parser state, and works
+ *  on the TwoWire instance given to its constructor (Wire by default), so a
+ *  board with several I2C peripherals can run one master per bus. Up to
+ *  MAX_CLIENT_INSTANCES clients can exist at once.
+ *
+ *  The master runs the bus at BUS_CLOCK unless setBusClock asks for another
+ *  one, 1 MHz (Fast-mode Plus) included. identifyClients probes at 100 kHz,
+ *  then settles on the fastest standard clock every client passes a PING
+ *  check at, and service steps the clock down when errors pile up.
+ *
+ *  No bus operation waits longer than WIRE_TIMEOUT_US where Wire can time
+ *  out. A client that keeps failing is quarantined, with a growing backoff,
+ *  and a bus that stops responding is freed by clocking SCL by hand.
+ *
+ *  Buffer sizes are template parameters, so each build only reserves the
+ *  memory it needs:
+ *    SWireMasterT<Clients, MsgLen, QueueDepth, OutQueueDepth>
+ *    SWireClientT<MsgLen, QueueDepth, UrgentDepth>
+ *  SWireMaster and SWireClient are these templates with the default sizes
+ *  below. A message written to a client must fit in the client's MsgLen.
+ *
+ *  A client's sendData takes an optional priority. Messages above
+ *  PRIORITY_NORMAL overtake whatever is already queued, so an alarm is never
+ *  stuck behind a backlog of telemetry.
+ *
+ *  Telemetry that is sent faster than the master reads it can go through
+ *  sendLatest instead, which keeps only the latest value for each key (the
+ *  message's first byte): a new message replaces a queued one with the same
+ *  key in place, so the queue stays bounded and the master gets fresh values.
+ *
+ *  A client that calls setCompression before the master's identifyClients
+ *  delta encodes the messages it sends against the one sent before them,
+ *  which takes slowly changing telemetry down to a few bytes a message.
+ *
+ *  Messages are binary: every packet carries an explicit length, so payloads
+ *  may contain any byte value, including 0x00 and the control characters
+ *  defined below. The char * overloads of sendData/getData are conveniences
+ *  for null terminated strings built on top of the binary ones.
  *
  *  Definitions:
- *    - Packet: Data in the form of {START}{MESSAGE}{PARITY}{END}
- *      - Currently, the first byte of the message is the client address
- *    - Valid addresses for clients are between 1 and MAX_CLIENTS
- *      - MAX_CLIENTS can be at most 126.
+ *    - Packet: Data in the form of
+ *        {START}{ADDRESS}{COMMAND}{SEQ}{LENGTH}{DATA * LENGTH}{CHECK}{END}
+ *      - COMMAND is one of WRITE, BATCH, READ, READ_BATCH, PING, BROADCAST,
+ *        REPLAY, STREAM_OPEN or STREAM.
+ *      - SEQ of a WRITE or BATCH is the master's sequence number for that
+ *        client. A retransmission reuses it, so the client can drop repeats.
+ *      - SEQ of a READ or READ_BATCH acknowledges the client's messages: it
+ *        is the sequence number of the next message the master expects.
+ *      - WRITE carries one message as its DATA.
+ *      - BATCH carries several messages for the same client, each one
+ *        written as {MESSAGE LENGTH}{MESSAGE DATA}, in up to MAX_BATCH_LEN
+ *        bytes of DATA.
+ *      - READ_BATCH carries one DATA byte: the most messages the master can
+ *        accept in the reply.
+ *      - Once the master has sent a broadcast, READ carries one more DATA
+ *        byte, and READ_BATCH a second one: the SEQ of the latest broadcast.
+ *      - BROADCAST goes to the general call address 0 and carries one
+ *        message, with the target in ADDRESS: BROADCAST_ALL or a group. Its
+ *        SEQ counts up across all targets from 1, skipping 0, so a client
+ *        that sees a SEQ out of turn knows it missed one. Nobody answers it.
+ *      - REPLAY is a BROADCAST sent again to one client by its own address,
+ *        with the original ADDRESS and SEQ. It is answered like a WRITE.
+ *      - STREAM_OPEN carries the length of a stream in 4 DATA bytes, least
+ *        significant first. The client answers ACK if it takes the stream,
+ *        NAK if it has nowhere to put it.
+ *      - STREAM carries the next STREAM_CHUNK bytes of the stream, SEQ
+ *        counting its frames from 0. A client only takes the frame it
+ *        expects next, and answers every STREAM with the low 7 bits of the
+ *        SEQ it expects next, or NAK if the frame failed its CHECK. A
+ *        STREAM without DATA is only answered, to find out how far the
+ *        client got after a NAK.
+ *      - PING carries one DATA byte, PING_DELTA, when the master can take
+ *        delta encoded messages. A client answers ACK_DELTA if it will send
+ *        them, ACK otherwise. Either end forgets its delta reference.
+ *      - CHECK covers ADDRESS, COMMAND, SEQ, LENGTH and every DATA byte.
+ *      - A client answers a packet that fails its CHECK with NAK.
+ *    - Reply: Data returned by a client for a READ, in the form of
+ *        {LENGTH}{SEQ}{DATA * LENGTH}{CHECK}
+ *      - The low bits of LENGTH (REPLY_LENGTH_MASK) hold the data length, a
+ *        length of 0 means the client had nothing to send.
+ *      - REPLY_MORE is set in LENGTH when the client has further messages
+ *        queued, in which case the master keeps reading from it.
+ *      - REPLY_URGENT is set as well when some of those are of a priority
+ *        above PRIORITY_NORMAL, in which case the master keeps reading for
+ *        longer (URGENT_BURST_MAX rather than POLL_BURST_MAX).
+ *      - REPLY_DELTA is set when the message of a READ reply is delta
+ *        encoded (see deltaCodec.h), MESSAGE_DELTA in the MESSAGE LENGTH of
+ *        each such message of a READ_BATCH reply. A message is encoded
+ *        against the one before it, the first of a reply against the last
+ *        one acknowledged, and only once it has such a reference.
+ *      - The reply to a READ_BATCH packs as many messages as fit, written
+ *        the same way as in a BATCH packet.
+ *      - Messages are sent highest priority first, oldest first within a
+ *        priority. SEQ is the sequence number of the first message in the
+ *        reply, the rest follow on consecutively. A client keeps each message until a
+ *        READ acknowledges it and sends it again until then; the master
+ *        drops messages it has already received.
+ *      - CHECK covers LENGTH, SEQ and every DATA byte.
+ *      - The master reads a reply in two requests: LENGTH alone, then
+ *        exactly the SEQ, DATA and CHECK bytes it announced.
+ *    - A client that is not sure it has seen the latest broadcast answers a
+ *      READ that names it with MISSED, in place of a LENGTH. The master
+ *      replays the latest broadcast to each target to it, oldest first.
+ *    - A client built with CLIENT_DEFERRED_RX answers BUSY, in place of an
+ *      ACK, NAK or LENGTH, while it has not parsed the last packet yet. The
+ *      master then asks again.
+ *    - CHECK is a CRC-8 (SMBus PEC, polynomial 0x07) when CHECK_CRC8 is 1,
+ *      or the XOR of the covered bytes when it is 0. Both ends must agree.
+ *    - Valid addresses for clients are between 1 and the master's Clients
+ *      - Clients can be at most 126.
  *
  *  The overall interaction method with this library should be through the 
  *  sendData and getData methods on the master and client objects. Unlike the
- *  notion of a message used internally, these strings do not contain the id
+ *  notion of a message used internally, this data does not contain the id
  *  of the intended recipient.
  *
- *  (Internally however, a "message" always contains the destination client id
- *   as the first byte)
+ *  Instead of polling getData, an application can register handlers with
+ *  onMessage, on the master for every client or for one of them, and have
+ *  service hand each message to them in place, without a copy. A dispatch
+ *  table set with setDispatchTable picks the handler by the message's first
+ *  byte, its type, ahead of those.
  *
+ *  (Internally however, a message is a swireMessage_t record that carries the
+ *   client id alongside the data)
  *
- *  Future improvements:
- *    - Switch to all length based binary processing to allow nulls
- *    - Have the client address be broken out into the packet datatype.
  *
  *  Current transaction structure:
  *    Client -> Master:
  *      1 M: {READ}
- *      2 C: {DATA}
- *      3 M: {ACK}
- *      4 C: {ACK}
+ *      2 C: {LENGTH}
+ *      3 C: {SEQ}{DATA}{CHECK}
+ *      (1 to 3 repeat with READ_BATCH while REPLY_MORE is set, up to
+ *       POLL_BURST_MAX times)
  *    
  *    Client -> Master (If no data):
  *      1 M: {READ}
- *      2 C: {ACK}
+ *      2 C: {LENGTH of 0}
  *    
  *    Master -> Client:
- *      1 M: {WRITE}{DATA}
+ *      1 M: {WRITE}{DATA} or {BATCH}{DATA}
+ *      2 C: {ACK}, or {NAK} to have the master resend it (up to MAX_RETRIES)
+ *
+ *    Master -> Client, streaming:
+ *      1 M: {STREAM_OPEN}{LENGTH}
  *      2 C: {ACK}
+ *      3 M: {STREAM}{DATA}, up to STREAM_WINDOW times
+ *      4 C: {SEQ of the next frame expected}
+ *      (3 to 4 repeat, one window per call to service, from the first frame
+ *       not acknowledged)
+ *
+ *    Master -> Clients:
+ *      1 M: {BROADCAST}{DATA}, to address 0
+ *      (on a later READ, a client answers {MISSED} and the master sends it
+ *       {REPLAY}{DATA} for each target, each answered like a WRITE)
  *
  *  @author Sebastian Mason (sebski123)
  */
 
 #pragma once
 #include "Arduino.h"
-#include "stringQueue.h"
+#include "messageQueue.h"
 #include <Wire.h>
+#include <stddef.h>
 
 // Control characters
 // All of the form 0x80 + (most appropriate ascii character)
@@ -67,45 +212,733 @@
 #define NO_DATA (char)0xB0
 #define PING (char)0xB1
 #define ESC (char)0x9B
+#define BATCH (char)0xC2
+#define READ_BATCH (char)0xF2
+#define BUSY (char)0xAE
+#define BROADCAST (char)0xC7
+#define REPLAY (char)0xD0
+#define MISSED (char)0xBF
+#define STREAM_OPEN (char)0xCF
+#define STREAM (char)0xD3
+#define ACK_DELTA (char)0xC4
 
-#define TIMEOUT 50
+// Default template parameters of SWireMaster and SWireClient
 #define MAX_CLIENTS 16
-#define MAX_MSG_LEN 16
-#define MAX_MASTER_QUEUE_SIZE 40
-#define MAX_CLIENT_QUEUE_SIZE 20
+#define MAX_MSG_LEN 16 // Maximum number of data bytes in one message
+#define MAX_MASTER_QUEUE_SIZE 32 // Must be a power of two
+#define MAX_MASTER_OUT_QUEUE_SIZE 16 // Must be a power of two
+#define MAX_CLIENT_QUEUE_SIZE 16 // Must be a power of two
 #define MAX_RETRIES 3
+#define CHECK_CRC8 1 // 0 to fall back to the XOR parity
+#define MAX_CLIENT_INSTANCES 2 // SWireClient objects per device, at most 4
+#define ENABLE_STATS 1 // 0 to compile out the counters behind getStats
+#define ENABLE_COMPRESSION 1 // 0 to compile out delta encoding, see setCompression
+
+// 1 to time every bus transaction and client ISR into a ring of the last
+// TRACE_DEPTH events (a power of two), see swireTraceDump. With 0 the trace
+// points compile to nothing.
+#define ENABLE_TRACE 0
+#define TRACE_DEPTH 32
+
+#if ENABLE_TRACE && ((TRACE_DEPTH & (TRACE_DEPTH - 1)) != 0 || TRACE_DEPTH > 128)
+#error "TRACE_DEPTH must be a power of two no larger than 128"
+#endif
+
+// 1 to keep the client's receive ISR down to copying bytes into a buffer of
+// RX_BUFFER_SIZE bytes (a power of two), leaving the parsing to
+// SWireClient::service. Until service has caught up the client answers BUSY,
+// and the master asks again up to MAX_BUSY_POLLS times.
+#define CLIENT_DEFERRED_RX 0
+#define RX_BUFFER_SIZE 64
+#define MAX_BUSY_POLLS 10
+
+// Sleep mode SWireClient::sleep uses, from avr/sleep.h. Power-down is the
+// deepest one a TWI address match still wakes the MCU from.
+#define CLIENT_SLEEP_MODE SLEEP_MODE_PWR_DOWN
+
+// Each client is polled at its own interval, in ms. A poll that returns data
+// drops the interval to its minimum; each empty poll doubles it up to the
+// maximum. The limits can be changed per client with setPollInterval.
+#define POLL_INTERVAL_MIN 5
+#define POLL_INTERVAL_MAX 100
+
+// The most messages read back to back from one client in a single scan
+#define POLL_BURST_MAX 8
+
+// Client outbound priority lanes, drained highest first. Lane 0
+// (PRIORITY_NORMAL) holds the client's QueueDepth messages, each lane above
+// it UrgentDepth. A client that still has messages above PRIORITY_NORMAL
+// queued after a reply says so with REPLY_URGENT, and the master keeps
+// reading it past POLL_BURST_MAX, up to URGENT_BURST_MAX.
+#define PRIORITY_LEVELS 2
+#define PRIORITY_NORMAL 0
+#define PRIORITY_URGENT 1
+#define URGENT_QUEUE_SIZE 4 // Must be a power of two
+#define URGENT_BURST_MAX 16
+
+#if PRIORITY_LEVELS < 2 || PRIORITY_LEVELS > 8
+#error "PRIORITY_LEVELS must be between 2 and 8"
+#endif
+
+// Bus clock in Hz the master starts at, see setBusClock. identifyClients
+// checks each client with LINK_CHECK_PINGS PINGs before settling on a clock,
+// and service drops the clock a step whenever more than CLOCK_MAX_ERRORS of
+// the last CLOCK_CHECK_WINDOW transactions failed.
+#define BUS_CLOCK 100000
+#define LINK_CHECK_PINGS 8
+#define CLOCK_CHECK_WINDOW 64
+#define CLOCK_MAX_ERRORS 4
+
+#if CLOCK_CHECK_WINDOW > 255
+#error "CLOCK_CHECK_WINDOW must fit in a byte"
+#endif
+
+// Deadlines in us. On cores with setWireTimeout, Wire gives up on a single
+// bus operation after WIRE_TIMEOUT_US, which stops a client holding the
+// clock or a stuck SDA line from hanging the master inside Wire. A write or
+// poll, BUSY polls and retries included, is abandoned after
+// TRANSACTION_TIMEOUT_US.
+#define WIRE_TIMEOUT_US 5000
+#define TRANSACTION_TIMEOUT_US 20000
+
+// A client that fails QUARANTINE_FAILURES transactions in a row is left
+// alone for QUARANTINE_MIN ms, doubling with every failure after that up to
+// QUARANTINE_MAX ms, so one bad node doesn't eat the bus time of the
+// others. Writes to it fail or are dropped meanwhile. The first transaction
+// that succeeds lets it back in.
+#define QUARANTINE_FAILURES 3
+#define QUARANTINE_MIN 50
+#define QUARANTINE_MAX 2000
+
+// A Wire timeout, or BUS_RECOVERY_FAILURES failed transactions in a row
+// across all clients, has service clock SCL until any client holding SDA
+// lets go, at most once every BUS_RECOVERY_INTERVAL ms. See
+// setRecoveryPins.
+#define NO_RECOVERY_PIN 0xFF
+#define BUS_RECOVERY_FAILURES 8
+#define BUS_RECOVERY_INTERVAL 10
+#define BUS_RECOVERY_CLOCKS 9
+
+// Time in ms between background probes for clients added at runtime, one
+// unknown address per probe. Can be changed with setRescanInterval.
+#define RESCAN_INTERVAL 100
+
+// Optional shared "data ready" line, see setAttentionPin. Clients pull it low
+// while they have messages queued; a master watching it only scans while it
+// is low, plus every ATTENTION_IDLE_POLL ms (0 for never) in case a client
+// isn't wired to it.
+#define NO_ATTENTION_PIN 0xFF
+#define ATTENTION_IDLE_POLL 1000
+
+// Broadcast targets, see broadcastData. BROADCAST_ALL reaches every client,
+// groups 1 to MAX_GROUPS only the clients that joined them. The master keeps
+// the latest broadcast to each target to replay to clients that missed it.
+#define BROADCAST_ALL 0
+#define MAX_GROUPS 4
+
+#if MAX_GROUPS > 7
+#error "MAX_GROUPS can be at most 7"
+#endif
+
+// Bytes a packet adds around its data: START, ADDRESS, COMMAND, SEQ, LENGTH,
+// CHECK and END. A reply adds LENGTH, SEQ and CHECK.
+#define PACKET_OVERHEAD 7
+#define REPLY_OVERHEAD 3
+
+// Fields of a reply's LENGTH byte
+#define REPLY_LENGTH_MASK 0x1F
+#define REPLY_DELTA 0x20
+#define REPLY_URGENT 0x40
+#define REPLY_MORE 0x80
+
+// Flag in a MESSAGE LENGTH of a READ_BATCH reply, and in the DATA of a PING
+#define MESSAGE_DELTA 0x80
+#define PING_DELTA 0x01
+
+// Most DATA bytes in a BATCH packet or a READ_BATCH reply. The default
+// fills a 32 byte Wire buffer.
+#define MAX_BATCH_LEN (32 - PACKET_OVERHEAD)
+
+#if defined(BUFFER_LENGTH) && MAX_BATCH_LEN + PACKET_OVERHEAD > BUFFER_LENGTH
+#error "MAX_BATCH_LEN does not fit in the Wire buffer"
+#endif
+#if MAX_BATCH_LEN > REPLY_LENGTH_MASK
+#error "MAX_BATCH_LEN does not fit in a reply's LENGTH field"
+#endif
+
+// Longest message any MsgLen can ask for: one that still fits in a batch
+#define MSG_LEN_LIMIT (MAX_BATCH_LEN - 1)
+
+// Most messages in one reply, each taking a length byte and at least one
+// data byte of a READ_BATCH reply
+#define MAX_REPLY_MESSAGES (MAX_BATCH_LEN / 2)
+
+// Streams, see beginStream. Each STREAM frame carries STREAM_CHUNK bytes,
+// the last one what is left, and the master writes up to STREAM_WINDOW
+// frames before reading the client's acknowledgement of them all. A stream
+// the client takes nothing of for STREAM_TIMEOUT ms fails.
+#define STREAM_CHUNK MSG_LEN_LIMIT
+#define STREAM_WINDOW 4
+#define STREAM_TIMEOUT 500
+
+#if STREAM_WINDOW < 1 || STREAM_WINDOW > 64
+#error "STREAM_WINDOW must be between 1 and 64"
+#endif
+
+// Only a reply with REPLY_DELTA set can look like these, and the client sends
+// its message as it is instead
+static_assert(((uint8_t)BUSY & REPLY_DELTA) || ((uint8_t)BUSY & REPLY_LENGTH_MASK) > MAX_BATCH_LEN,
+              "BUSY must not look like a reply LENGTH");
+static_assert(((uint8_t)MISSED & REPLY_DELTA) || ((uint8_t)MISSED & REPLY_LENGTH_MASK) > MAX_BATCH_LEN,
+              "MISSED must not look like a reply LENGTH");
+#if CLIENT_DEFERRED_RX && ((RX_BUFFER_SIZE & (RX_BUFFER_SIZE - 1)) != 0 || RX_BUFFER_SIZE > 128)
+#error "RX_BUFFER_SIZE must be a power of two no larger than 128"
+#endif
+
+/** @brief A queued message, stored inline in a messageQueue_t record
+ *
+ *  Queue records only hold the first msg_len bytes of data, as sized by
+ *  MESSAGE_RECORD_LEN.
+ */
+typedef struct {
+  uint8_t address; // Client the message came from or is destined for
+  uint8_t length;  // Number of valid bytes in data
+  uint8_t data[MSG_LEN_LIMIT];
+} swireMessage_t;
+
+#define MESSAGE_RECORD_LEN(msg_len) (offsetof(swireMessage_t, data) + (msg_len))
+
+/** @brief Messages packed as {MESSAGE LENGTH}{MESSAGE DATA} for one BATCH */
+typedef struct {
+  uint8_t data[MAX_BATCH_LEN];
+  uint8_t length; // Number of valid bytes in data
+  uint8_t count;  // Messages packed into data
+} swireBatch_t;
+
+// Bytes the master keeps per client to decode delta encoded messages
+#define DELTA_REF_LEN(msg_len) (ENABLE_COMPRESSION ? (msg_len) : 0)
+
+/** @brief Poll counters for one client, kept by the master */
+typedef struct {
+  uint32_t polls;  // READ and READ_BATCH transactions
+  uint32_t hits;   // Polls that returned messages
+  uint32_t misses; // Polls that found nothing to read
+  uint32_t errors; // Polls that failed on the bus or their CHECK
+} swirePollStats_t;
 
-int readPacket(char *buffer);
-int sendPacket(char *message);
-void receiveEvent(int howMany);
-void requestEvent();
+/** @brief Master-side bookkeeping for one client, parallel to _clients */
+typedef struct {
+  unsigned long next_poll; // millis() at which the client is next due
+  uint16_t interval;       // Current polling interval in ms
+  uint16_t min_interval;
+  uint16_t max_interval;
+  uint8_t rx_next;         // Sequence number of the next message expected
+  bool rx_synced;          // Whether rx_next is known yet
+  bool replay;             // Whether the client still needs broadcasts replayed
+  uint8_t failures;        // Transactions failed in a row
+  uint16_t backoff;        // Current quarantine in ms, 0 while not quarantined
+  unsigned long quarantine_end; // millis() at which the quarantine ends
+  uint8_t delta_length;    // Length of the last message received, 0 while
+                           // there is no delta reference
+  bool burst;              // Whether scanMessages still owes it a burst
+#if ENABLE_STATS
+  swirePollStats_t stats;
+#endif
+} clientState_t;
 
-extern stringQueue_t _in_messages;
-extern stringQueue_t _out_messages;
-extern volatile char currentCommand;
+/** @brief Counters for the traffic a master or client has handled
+ *
+ *  Overhead is every byte clocked for a transaction that is not message
+ *  data: addresses, framing and acknowledgements. Only transactions that
+ *  carry messages are counted, so overhead_bytes / messages is the cost per
+ *  message and overhead_bytes / frames the cost per transaction.
+ *
+ *  A client only counts messages, frames, retries, duplicates, check_failures,
+ *  sleeps, coalesced, the messages it had no room for in queue_full, those
+ *  received and those refused by sendData, and the stream bytes it took in
+ *  payload_bytes; the overhead,
+ *  bus, recovery and delta_saved counters are the master's. Payload bytes
+ *  are counted as they were sent, delta encoded or not.
+ *  On the master, latency is the time of one write or poll, including its
+ *  retries. On a client it is the time from waking up in sleep to answering
+ *  the master. The average is latency_total_us / latency_samples.
+ *
+ *  With ENABLE_STATS 0 none of this is kept, and getStats, getClientStats
+ *  and resetStats don't exist.
+ */
+typedef struct {
+  uint32_t messages;       // Messages carried in either direction
+  uint32_t frames;         // Transactions that carried them
+  uint32_t payload_bytes;  // Message data bytes
+  uint32_t overhead_bytes; // Every other byte of those transactions
+  uint32_t dropped;        // Queued writes given up on after MAX_RETRIES
+  uint32_t retries;        // Writes resent after a NAK or a missing ACK,
+                           // or on a client messages sent again
+  uint32_t duplicates;     // Messages received again and dropped
+  uint32_t queue_full;     // Messages refused because a queue was full
+  uint32_t check_failures; // Packets or replies that failed their CHECK
+  uint32_t bus_errors;     // Transactions the bus did not complete
+  uint32_t timeouts;       // Bus operations Wire gave up on, see WIRE_TIMEOUT_US
+  uint32_t recoveries;     // Times SCL was clocked to free the bus
+  uint32_t quarantines;    // Times a client was quarantined, see QUARANTINE_MIN
+  uint32_t coalesced;      // Queued messages replaced by sendLatest
+  uint32_t delta_saved;    // Message bytes delta encoding kept off the bus
+  uint32_t sleeps;         // Times a client slept, see SWireClient::sleep
+  uint32_t latency_min_us; // 0xFFFFFFFF until the first sample
+  uint32_t latency_max_us;
+  uint32_t latency_total_us;
+  uint32_t latency_samples;
+} swireStats_t;
+
+/** @brief Supplies a master's stream, see beginStream
+ *
+ *  @param offset   Where in the stream the bytes start
+ *  @param data     The buffer to fill
+ *  @param length   The number of bytes to fill it with
+ *  @param context  The context given to beginStream
+ *  @return Whether data was filled, false to abandon the stream
+ */
+typedef bool (*swireStreamSource_t)(uint32_t offset, uint8_t *data, uint8_t length,
+                                    void *context);
+
+/** @brief Takes a client's stream, see receiveStream
+ *
+ *  @param offset   Where in the stream the bytes start
+ *  @param data     The bytes received
+ *  @param length   The number of bytes at data
+ *  @param context  The context given to receiveStream
+ *  @return Whether the bytes were taken, false to have the master send them
+ *          again later
+ */
+typedef bool (*swireStreamSink_t)(uint32_t offset, const uint8_t *data, uint8_t length,
+                                  void *context);
+
+/** @brief Takes a received message, see onMessage
+ *
+ *  @param address  On the master, the ID of the client that sent it. On a
+ *                  client, its own address, or the group of a broadcast.
+ *  @param data     The message, valid until the handler returns
+ *  @param length   The number of bytes at data, at least 1
+ *  @param context  The context given with the handler
+ */
+typedef void (*swireMessageHandler_t)(uint8_t address, const uint8_t *data, uint8_t length,
+                                      void *context);
+
+/** @brief A handler and its context */
+typedef struct {
+  swireMessageHandler_t handler;
+  void *context;
+} swireHandler_t;
+
+/** @brief One entry of a dispatch table, see setDispatchTable */
+typedef struct {
+  uint8_t type; // First byte of the messages it takes
+  swireMessageHandler_t handler;
+} swireDispatchEntry_t;
+
+// Phases of a trace event, with what its bytes and result hold
+#define TRACE_SEND 0        // sendPacket: packet bytes, 1 if acknowledged
+#define TRACE_REQUEST 1     // requestFrom: bytes asked for, bytes received
+#define TRACE_POLL 2        // One poll: 1 for READ_BATCH, readMessage's result
+#define TRACE_WRITE 3       // One WRITE or BATCH and its retries: data bytes, 1 if ACKed
+#define TRACE_SCAN 4        // One scanMessages sweep: polls, 0 if cut short
+#define TRACE_RECEIVE_ISR 5 // Client receiveEvent: bytes, readPacket's result
+#define TRACE_REQUEST_ISR 6 // Client requestEvent: bytes, 1 for a reply, 0 for
+                            // a one byte answer, -1 for BUSY
+
+/** @brief One timed event of the trace, see ENABLE_TRACE */
+typedef struct {
+  uint32_t time_us;     // micros() at the start of the phase
+  uint16_t duration_us; // Capped at 0xFFFF
+  uint8_t address;      // The client, the client's own address in its ISRs,
+                        // 0 for a sweep or a general call
+  uint8_t phase;        // One of the TRACE_ phases
+  uint8_t bytes;
+  int8_t result;
+} swireTraceEvent_t;
+
+#if ENABLE_TRACE
+uint8_t swireTraceRead(swireTraceEvent_t *events, uint8_t max_events);
+void swireTraceDump(Print &out);
+void swireTraceClear();
+#endif
 
-class SWireMaster
+/** @brief Progress of readPacket through a packet, kept per bus */
+typedef struct {
+  uint8_t msg_len;      // Longest message accepted
+  uint8_t state;
+  uint8_t address;
+  char command;
+  uint8_t seq;
+  uint8_t remaining;    // DATA bytes left in the packet
+  uint8_t message_left; // DATA bytes left in the current message
+  uint8_t records;      // Queue records filled by the packet
+  swireMessage_t *message;
+  uint8_t checksum;
+  bool valid;
+  bool dropped;           // A message did not fit in the queue
+  swireMessage_t scratch; // Non-message packet data and dropped messages
+} packetReader_t;
+
+void packetReaderInit(packetReader_t *reader, uint8_t msg_len);
+int packetReaderFeed(packetReader_t *reader, messageQueue_t *queue, uint8_t rc,
+                     char *command, uint8_t *seq, uint8_t *count);
+int readPacket(TwoWire &wire, packetReader_t *reader, messageQueue_t *queue,
+               char *command, uint8_t *seq, uint8_t *count);
+int sendPacket(TwoWire &wire, uint8_t address, char command, uint8_t seq,
+               const uint8_t *data, uint8_t length);
+int sendPacketTo(TwoWire &wire, uint8_t bus_address, uint8_t address, char command,
+                 uint8_t seq, const uint8_t *data, uint8_t length);
+
+/** @brief The master's implementation, working on storage given by SWireMasterT */
+class SWireMasterBase
 {
 public:
-  SWireMaster();
   int sendData(uint8_t client_id, char *data);
+  int sendData(uint8_t client_id, const uint8_t *data, size_t length);
+  int beginBatch(uint8_t client_id);
+  int addToBatch(const uint8_t *data, size_t length);
+  int endBatch();
+  int broadcastData(uint8_t group, char *data);
+  int broadcastData(uint8_t group, const uint8_t *data, size_t length);
+  int beginStream(uint8_t client_id, const uint8_t *data, uint32_t length);
+  int beginStream(uint8_t client_id, uint32_t length, swireStreamSource_t source,
+                  void *context);
+  int streamStatus(uint32_t *acknowledged);
+  void cancelStream();
   int getData(char *buffer);
+  int getData(uint8_t *buffer, size_t size, uint8_t *client_id);
+  int peekData(const uint8_t **data, uint8_t *client_id);
+  void releaseData();
+  int onMessage(swireMessageHandler_t handler, void *context);
+  int onMessage(uint8_t client_id, swireMessageHandler_t handler, void *context);
+  void setDispatchTable(const swireDispatchEntry_t *table, uint8_t count, void *context);
   int identifyClients();
   int getClients(uint8_t *clients);
+  int setPollInterval(uint8_t client_id, uint16_t min_ms, uint16_t max_ms);
+#if ENABLE_STATS
+  const swireStats_t *getStats();
+  const swirePollStats_t *getClientStats(uint8_t client_id);
+  void resetStats();
+#endif
+  uint8_t getQueueHighWater(bool outgoing);
+  void service();
+  void setRescanInterval(uint16_t interval_ms);
+  void setBusClock(uint32_t clock_hz);
+  uint32_t getBusClock();
+  void setAttentionPin(uint8_t pin);
+  void setRecoveryPins(uint8_t sda_pin, uint8_t scl_pin);
+  bool isQuarantined(uint8_t client_id);
+
+protected:
+  SWireMasterBase(TwoWire &wire, uint8_t max_clients, uint8_t msg_len,
+                  uint8_t *clients, clientState_t *client_state, uint8_t *tx_seq,
+                  uint8_t *in_storage, uint8_t in_depth,
+                  uint8_t *out_storage, uint8_t out_depth,
+                  uint8_t *broadcast_storage, swireHandler_t *handlers,
+                  uint8_t *delta_refs);
 
 private:
+  void beginBus();
+  bool pingClient(uint8_t client_id);
+  bool probeClient(uint8_t client_id);
+  bool resyncClient(uint8_t index);
+  void addClient(uint8_t client_id);
+  clientState_t *findClient(uint8_t client_id);
+  bool quarantined(clientState_t *state);
+  void noteResult(clientState_t *state, bool ok);
+  void recoverBus();
+  int requestReply(uint8_t client_id);
+  bool slowDownClock();
+  void negotiateClock();
+  void checkClock();
+  void rescanClients();
+  void flushMessages();
   void scanMessages();
+  int burstClient(uint8_t index, int result);
+  void schedulePoll(clientState_t *state, int result, unsigned long now);
+  int readMessage(uint8_t index, bool batch);
+  swireMessage_t *replyRecord(clientState_t *state, uint8_t seq, uint8_t *records);
+  int exchangePacket(uint8_t client_id, uint8_t address, char command, uint8_t seq,
+                     const uint8_t *data, uint8_t length);
+  int writeFrame(uint8_t client_id, char command, const uint8_t *data,
+                 uint8_t length, uint8_t messages);
+  int writeBatch(uint8_t client_id, const swireBatch_t *batch);
+  bool replayBroadcasts(uint8_t client_id);
+  void pumpStream();
+  void endStream(int8_t result);
+  int pollClient(uint8_t index, bool batch);
+  void recordLatency(unsigned long start);
+  void dispatchMessages();
+  TwoWire &_wire;
+  uint8_t _max_clients;
+  uint8_t _msg_len;
+  // Filled by scanMessages and emptied by getData, written by sendData and
+  // sent by flushMessages
+  messageQueue_t _in_messages;
+  messageQueue_t _out_messages;
+  swireMessage_t _scratch; // Destination for messages received twice
+#if ENABLE_STATS
+  swireStats_t _stats;
+#endif
+  // The application's batch, from beginBatch to endBatch, and the frame
+  // flushMessages builds, kept apart so service() can't discard the former
+  swireBatch_t _batch;
+  swireBatch_t _out_frame;
+  uint8_t _batch_client;
+  uint8_t _out_retries; // Failed attempts at the head of _out_messages
+  uint8_t _out_sent;    // Messages at its head last written without a known
+                        // outcome, to be resent as they were, 0 for none
+  uint8_t *_tx_seq; // Next write sequence number, by address
+  // onMessage handlers by address, index 0 for every client, and the
+  // dispatch table tried before them. _dispatching guards against handlers
+  // that end up in service again.
+  swireHandler_t *_handlers;
+  const swireDispatchEntry_t *_dispatch_table;
+  uint8_t _dispatch_count;
+  void *_dispatch_context;
+  bool _dispatching;
+  // The latest broadcast to each target, by group, and its SEQ (0 for none
+  // yet). _broadcast_last is the SEQ of the latest broadcast of all, sent
+  // with every READ so clients can tell whether they missed one.
+  uint8_t *_broadcasts;
+  uint8_t _broadcast_seqs[MAX_GROUPS + 1];
+  uint8_t _broadcast_last;
+  // The stream being written to _stream_client, none while it is 0.
+  // _stream_acked bytes have been acknowledged, the first frame after them
+  // has SEQ _stream_frame. _stream_result is how the last stream ended.
+  uint8_t _stream_client;
+  bool _stream_opened;
+  int8_t _stream_result;
+  uint8_t _stream_frame;
+  unsigned long _stream_progress; // millis() when the client last took a frame
+  uint8_t _stream_window; // Frames to write per window
+  uint32_t _stream_length;
+  uint32_t _stream_acked;
+  swireStreamSource_t _stream_source;
+  void *_stream_context;
+  uint16_t _rescan_interval;
+  unsigned long _last_rescan;
+  uint8_t _attention_pin;
+  unsigned long _last_scan; // millis() of the last scan with attention released
+  uint8_t _scan_next;       // Index in _clients of the client the next scan starts at
+  uint8_t _rescan_next; // Last address probed by the background rescan
+  uint32_t _clock_target; // Fastest clock allowed by setBusClock
+  uint32_t _clock;
+  uint8_t _link_transactions; // Since the last checkClock
+  uint8_t _link_errors;
+  // Set by a Wire timeout or _bus_failures failures in a row, cleared by
+  // recoverBus
+  bool _bus_suspect;
+  uint8_t _bus_failures;
+  unsigned long _last_recovery;
+  uint8_t _sda_pin;
+  uint8_t _scl_pin;
   uint8_t _num_clients;
-  uint8_t _clients[MAX_CLIENTS];
+  uint8_t *_clients;
+  clientState_t *_client_state; // Parallel to _clients
+  // The last message received from each client, DELTA_REF_LEN(_msg_len)
+  // bytes each, by index in _clients
+  uint8_t *_delta_refs;
 };
 
-class SWireClient
+/** @brief A master sized for Clients clients, MsgLen byte messages and
+ *         queues of QueueDepth incoming and OutQueueDepth outgoing messages
+ */
+template <uint8_t Clients = MAX_CLIENTS, uint8_t MsgLen = MAX_MSG_LEN,
+          uint8_t QueueDepth = MAX_MASTER_QUEUE_SIZE,
+          uint8_t OutQueueDepth = MAX_MASTER_OUT_QUEUE_SIZE>
+class SWireMasterT : public SWireMasterBase
 {
+  static_assert(Clients >= 1 && Clients <= 126, "Clients must be between 1 and 126");
+  static_assert(MsgLen >= 1 && MsgLen <= MSG_LEN_LIMIT, "MsgLen must leave room for a message in a batch");
+  static_assert((QueueDepth & (QueueDepth - 1)) == 0 && QueueDepth >= 1 && QueueDepth <= 128,
+                "QueueDepth must be a power of two no larger than 128");
+  static_assert((OutQueueDepth & (OutQueueDepth - 1)) == 0 && OutQueueDepth >= 1 && OutQueueDepth <= 128,
+                "OutQueueDepth must be a power of two no larger than 128");
+
 public:
-  SWireClient(uint8_t client_number);
-  int sendData(char *data);
+  SWireMasterT(TwoWire &wire = Wire)
+      : SWireMasterBase(wire, Clients, MsgLen, _client_ids, _client_info, _seqs,
+                        _in_storage, QueueDepth, _out_storage, OutQueueDepth,
+                        _broadcast_storage, _handler_storage, _delta_storage) {}
+
+private:
+  uint8_t _client_ids[Clients];
+  clientState_t _client_info[Clients];
+  uint8_t _seqs[Clients + 1];
+  uint8_t _in_storage[QueueDepth * MESSAGE_RECORD_LEN(MsgLen)];
+  uint8_t _out_storage[OutQueueDepth * MESSAGE_RECORD_LEN(MsgLen)];
+  uint8_t _broadcast_storage[(MAX_GROUPS + 1) * MESSAGE_RECORD_LEN(MsgLen)];
+  swireHandler_t _handler_storage[Clients + 1];
+  uint8_t _delta_storage[Clients * DELTA_REF_LEN(MsgLen) + 1];
+};
+
+typedef SWireMasterT<> SWireMaster;
+
+/** @brief The client's implementation, working on storage given by SWireClientT */
+class SWireClientBase
+{
+public:
+  int sendData(char *data, uint8_t priority = PRIORITY_NORMAL);
+  int sendData(const uint8_t *data, size_t length, uint8_t priority = PRIORITY_NORMAL);
+  int sendLatest(const uint8_t *data, size_t length, uint8_t priority = PRIORITY_NORMAL);
   int getData(char *buffer);
+  int getData(uint8_t *buffer, size_t size);
+  int peekData(const uint8_t **data);
+  void releaseData();
+  int onMessage(swireMessageHandler_t handler, void *context);
+  void setDispatchTable(const swireDispatchEntry_t *table, uint8_t count, void *context);
+#if ENABLE_STATS
+  const swireStats_t *getStats();
+  void resetStats();
+#endif
+  uint8_t getQueueHighWater(bool outgoing, uint8_t priority = PRIORITY_NORMAL);
+  void service();
+  void setAttentionPin(uint8_t pin);
+  int joinGroup(uint8_t group);
+  int leaveGroup(uint8_t group);
+  int receiveStream(uint8_t *buffer, uint32_t size);
+  int receiveStream(swireStreamSink_t sink, void *context);
+  int streamStatus(uint32_t *received, uint32_t *length);
+  int sleep();
+  void setSleepHooks(void (*before_sleep)(), void (*after_wake)());
+  void setCompression(bool enable);
+
+  template <uint8_t N>
+  static void receiveTrampoline(int howMany);
+  template <uint8_t N>
+  static void requestTrampoline();
+
+protected:
+  SWireClientBase(uint8_t client_number, TwoWire &wire, uint8_t msg_len,
+                  uint8_t *in_storage, uint8_t *out_storage, uint8_t depth,
+                  uint8_t *urgent_storage, uint8_t urgent_depth);
 
 private:
+  void receiveEvent(int howMany);
+  void requestEvent();
+  void handlePacket(int result, char command, uint8_t seq, uint8_t count);
+  void handleBroadcast(int result, char command, uint8_t seq, uint8_t count);
+  void handleStream(char command, uint8_t seq);
+  void wakeUp(bool answering);
+  bool canSleep();
+  void stageReply(bool batch, uint8_t limit);
+  void updateAttention();
+  void dispatchMessages();
+  TwoWire &_wire;
   uint8_t _client_number;
+  uint8_t _msg_len;
+  // Each queue has one producer and one consumer, so neither needs
+  // interrupts disabled: receiveEvent (ISR) fills _in_messages for getData,
+  // sendData fills _out_messages for requestEvent (ISR). _out_messages is
+  // indexed by priority.
+  messageQueue_t _in_messages;
+  messageQueue_t _out_messages[PRIORITY_LEVELS];
+  packetReader_t _reader;
+  // Set by onMessage and setDispatchTable, called from service
+  swireHandler_t _handler;
+  const swireDispatchEntry_t *_dispatch_table;
+  uint8_t _dispatch_count;
+  void *_dispatch_context;
+#if CLIENT_DEFERRED_RX
+  // Raw bytes from receiveEvent (ISR) waiting for service
+  messageQueue_t _rx_bytes;
+  uint8_t _rx_bytes_storage[RX_BUFFER_SIZE];
+#endif
+  volatile uint8_t _answer; // Next single byte answer: ACK, NAK, NO_DATA or a LENGTH
+#if ENABLE_STATS
+  swireStats_t _stats;
+#endif
+
+  // The SEQ, DATA and CHECK of the reply announced by _answer. It is staged
+  // until the LENGTH has been sent, then pending until the next request.
+  uint8_t _reply[MAX_BATCH_LEN + 2];
+  volatile uint8_t _reply_length;
+  volatile uint8_t _reply_count; // Messages in the reply
+  volatile bool _reply_staged;
+  volatile bool _reply_pending;
+
+  // _out_seq is the number of the oldest message not yet acknowledged;
+  // _out_sent messages have been sent at least once, and _sent_lanes holds
+  // the priority of each, in sequence order. Those are the oldest of their
+  // lanes. _rx_seq is the SEQ of the last WRITE or BATCH accepted, used to
+  // drop retransmissions.
+  volatile uint8_t _out_seq;
+  volatile uint8_t _out_sent;
+  uint8_t _sent_lanes[MAX_REPLY_MESSAGES];
+  uint8_t _rx_seq;
+  bool _rx_synced;
+#if ENABLE_COMPRESSION
+  // _delta_enabled is set by setCompression, _delta_active once the master
+  // accepted it in a PING. _delta_ref is the last message acknowledged, the
+  // reference for the next reply, none while _delta_ref_length is 0.
+  bool _delta_enabled;
+  volatile bool _delta_active;
+  uint8_t _delta_ref[MSG_LEN_LIMIT];
+  uint8_t _delta_ref_length;
+#endif
+
+  // _groups has a bit for each group joined, bit 0 (BROADCAST_ALL) always
+  // set. _broadcast_seq is the SEQ of the last broadcast seen, which is up to
+  // date while _broadcast_synced; _broadcast_missed says a broadcast was
+  // seen to be lost. _broadcast_taken holds the SEQ of the last broadcast
+  // taken from each target, valid where _broadcast_known has its bit set, so
+  // a replay of one already taken is dropped.
+  uint8_t _groups;
+  volatile uint8_t _broadcast_seq;
+  volatile bool _broadcast_synced;
+  volatile bool _broadcast_missed;
+  uint8_t _broadcast_taken[MAX_GROUPS + 1];
+  uint8_t _broadcast_known;
+
+  // The stream being received, passed to _stream_sink as it arrives.
+  // _stream_size is the longest stream the client takes, _stream_next the
+  // SEQ of the frame it expects next.
+  swireStreamSink_t _stream_sink;
+  void *_stream_context;
+  uint32_t _stream_size;
+  volatile uint32_t _stream_length;
+  volatile uint32_t _stream_received;
+  volatile uint8_t _stream_next;
+  volatile bool _stream_open;
+
+  // _asleep is set while sleep waits for an interrupt. The first ISR after
+  // it sets _woke_us, and the answer that follows records the wake-to-reply
+  // time, pending while _waking.
+  volatile bool _asleep;
+  volatile bool _waking;
+  volatile uint32_t _woke_us;
+  void (*_before_sleep)();
+  void (*_after_wake)();
+
+  uint8_t _attention_pin;
+  volatile bool _attention_asserted;
 };
+
+/** @brief A client sized for MsgLen byte messages and queues of QueueDepth
+ *         messages each way, plus UrgentDepth for each priority above
+ *         PRIORITY_NORMAL
+ */
+template <uint8_t MsgLen = MAX_MSG_LEN, uint8_t QueueDepth = MAX_CLIENT_QUEUE_SIZE,
+          uint8_t UrgentDepth = URGENT_QUEUE_SIZE>
+class SWireClientT : public SWireClientBase
+{
+  static_assert(MsgLen >= 1 && MsgLen <= MSG_LEN_LIMIT, "MsgLen must leave room for a message in a batch");
+  static_assert((QueueDepth & (QueueDepth - 1)) == 0 && QueueDepth >= 1 && QueueDepth <= 128,
+                "QueueDepth must be a power of two no larger than 128");
+  static_assert((UrgentDepth & (UrgentDepth - 1)) == 0 && UrgentDepth >= 1 && UrgentDepth <= 128,
+                "UrgentDepth must be a power of two no larger than 128");
+
+public:
+  SWireClientT(uint8_t client_number, TwoWire &wire = Wire)
+      : SWireClientBase(client_number, wire, MsgLen, _in_storage, _out_storage, QueueDepth,
+                        _urgent_storage, UrgentDepth) {}
+
+private:
+  uint8_t _in_storage[QueueDepth * MESSAGE_RECORD_LEN(MsgLen)];
+  uint8_t _out_storage[QueueDepth * MESSAGE_RECORD_LEN(MsgLen)];
+  uint8_t _urgent_storage[(PRIORITY_LEVELS - 1) * UrgentDepth * MESSAGE_RECORD_LEN(MsgLen)];
+};
+
+typedef SWireClientT<> SWireClient;
@@ -0,0 +1,16 @@
+#include "crc8.h"
+
+// Shifts one table index through all eight bits of the polynomial division
+static constexpr uint8_t crc8Step(uint8_t crc, uint8_t bits) {
+	return bits == 0 ? crc
+	                 : crc8Step((crc & 0x80) ? (uint8_t)((crc << 1) ^ CRC8_POLYNOMIAL)
+	                                         : (uint8_t)(crc << 1), bits - 1);
+}
+
+#define CRC8_4(i) crc8Step((i), 8), crc8Step((i) + 1, 8), crc8Step((i) + 2, 8), crc8Step((i) + 3, 8)
+#define CRC8_16(i) CRC8_4(i), CRC8_4((i) + 4), CRC8_4((i) + 8), CRC8_4((i) + 12)
+#define CRC8_64(i) CRC8_16(i), CRC8_16((i) + 16), CRC8_16((i) + 32), CRC8_16((i) + 48)
+
+const uint8_t crc8Table[256] PROGMEM = {
+	CRC8_64(0), CRC8_64(64), CRC8_64(128), CRC8_64(192)
+};
@@ -0,0 +1,20 @@
+/** @file crc8.h
+ *  @brief Headers and definitions for an incremental CRC-8.
+ *
+ *  Uses the SMBus PEC polynomial (x^8 + x^2 + x + 1, 0x07) with an initial
+ *  value of 0. The lookup table is generated at compile time and stored in
+ *  program memory, so it costs no RAM.
+ *
+ *  @author Sebastian Mason (sebski123)
+ */
+#pragma once
+#include "Arduino.h"
+
+#define CRC8_POLYNOMIAL 0x07
+#define CRC8_INIT 0x00
+
+extern const uint8_t crc8Table[256] PROGMEM;
+
+static inline uint8_t crc8Update(uint8_t crc, uint8_t data) {
+	return pgm_read_byte(&crc8Table[crc ^ data]);
+}
@@ -0,0 +1,77 @@
+#include "deltaCodec.h"
+
+static inline uint8_t refAt(const uint8_t *ref, uint8_t ref_length, uint8_t index) {
+	return (index < ref_length) ? ref[index] : 0;
+}
+
+/** @brief Encodes a message against a reference
+ *
+ *  @param data        The message
+ *  @param length      The number of bytes at data
+ *  @param ref         The reference to encode against
+ *  @param ref_length  The number of bytes at ref
+ *  @param out         The buffer to encode into
+ *  @param out_size    The most bytes to write to out
+ *  @return The number of bytes written, 0 if the encoding needs more than
+ *          out_size
+ */
+uint8_t deltaEncode(const uint8_t *data, uint8_t length, const uint8_t *ref, uint8_t ref_length,
+                    uint8_t *out, uint8_t out_size) {
+	uint8_t written = 0;
+	uint8_t i = 0;
+	while(i < length) {
+		uint8_t same = 0;
+		while(i < length && same < DELTA_RUN_MAX && data[i] == refAt(ref, ref_length, i)) {
+			same++;
+			i++;
+		}
+		uint8_t start = i;
+		while(i < length && i - start < DELTA_RUN_MAX && data[i] != refAt(ref, ref_length, i)) {
+			i++;
+		}
+		uint8_t literals = i - start;
+		if(written + 1 + literals > out_size) {
+			return 0;
+		}
+		out[written++] = (same << 4) | literals;
+		for(uint8_t j = start; j < i; j++) {
+			out[written++] = data[j] ^ refAt(ref, ref_length, j);
+		}
+	}
+	return written;
+}
+
+/** @brief Decodes a message encoded with deltaEncode
+ *
+ *  Each byte of out only depends on the reference byte at the same position,
+ *  so out may be ref itself to decode in place.
+ *
+ *  @param in          The encoded message
+ *  @param in_length   The number of bytes at in
+ *  @param ref         The reference it was encoded against
+ *  @param ref_length  The number of bytes at ref
+ *  @param out         The buffer to decode into
+ *  @param out_size    The longest message out can take
+ *  @return The length of the message, 0 if the encoding is malformed or the
+ *          message would be longer than out_size
+ */
+uint8_t deltaDecode(const uint8_t *in, uint8_t in_length, const uint8_t *ref, uint8_t ref_length,
+                    uint8_t *out, uint8_t out_size) {
+	uint8_t length = 0;
+	uint8_t i = 0;
+	while(i < in_length) {
+		uint8_t header = in[i++];
+		uint8_t same = header >> 4;
+		uint8_t literals = header & 0x0F;
+		if(header == 0 || length + same + literals > out_size || i + literals > in_length) {
+			return 0;
+		}
+		for(uint8_t j = 0; j < same; j++, length++) {
+			out[length] = refAt(ref, ref_length, length);
+		}
+		for(uint8_t j = 0; j < literals; j++, length++) {
+			out[length] = refAt(ref, ref_length, length) ^ in[i++];
+		}
+	}
+	return length;
+}
@@ -0,0 +1,26 @@
+/** @file deltaCodec.h
+ *  @brief Headers and definitions for a delta encoding of messages.
+ *
+ *  A message is encoded against a reference, normally the message sent
+ *  before it, as the XOR of the two, with runs of unchanged (zero) bytes
+ *  collapsed. Bytes past the end of the reference count as 0, so a message
+ *  may be longer or shorter than its reference.
+ *
+ *  The encoding is a sequence of tokens, each a header byte followed by
+ *  literal bytes. The high nibble of the header is the number of unchanged
+ *  bytes to copy from the reference, 0 to 15, the low nibble the number of
+ *  literal bytes that follow, 0 to 15, each XORed with the reference byte at
+ *  its position. A header of 0 is never written. The decoded length is the
+ *  sum of all runs and literals.
+ *
+ *  @author Sebastian Mason (sebski123)
+ */
+#pragma once
+#include "Arduino.h"
+
+#define DELTA_RUN_MAX 15
+
+uint8_t deltaEncode(const uint8_t *data, uint8_t length, const uint8_t *ref, uint8_t ref_length,
+                    uint8_t *out, uint8_t out_size);
+uint8_t deltaDecode(const uint8_t *in, uint8_t in_length, const uint8_t *ref, uint8_t ref_length,
+                    uint8_t *out, uint8_t out_size);
@@ -0,0 +1,956 @@
+/** @file bench.cpp
+ *  @brief Host benchmark for SWire over the simulated bus.
+ *
+ *  Runs a master against N simulated client devices for a stretch of
+ *  simulated time and reports:
+ *    - Messages per second from the clients (up) and to them (down).
+ *    - Percentiles of the time from a client's sendData to the master's
+ *      getData, in simulated microseconds.
+ *    - The worst such time for alarms, sent at PRIORITY_URGENT on top of the
+ *      regular traffic.
+ *    - The worst time from the master's broadcastData to a client's
+ *      getData, replays included.
+ *    - The rate at which a stream to the first client was acknowledged.
+ *    - Sequence gaps, i.e. messages that never arrived, messages that
+ *      arrived corrupt, and retries.
+ *    - The messages each client got through, and once the traffic stops and
+ *      the queues have drained, messages that never arrived at all and
+ *      messages that arrived more than once.
+ *    - The share of the time the bus was busy.
+ *    - With a fault injected on the first client, the timeouts, bus
+ *      recoveries and quarantines the master went through.
+ *    - With delta encoding, the message bytes it kept off the bus.
+ *    - The RAM taken by the master and client objects.
+ *    - With -T and ENABLE_TRACE, the count, mean and worst duration of each
+ *      traced phase, master and clients together.
+ *
+ *  Every message carries the time it was queued, its priority and a
+ *  sequence number per client and priority, which is all the receiver needs
+ *  to measure latency and losses.
+ *
+ *  With no options the default suite below is run. Any option runs a single
+ *  scenario instead, see usage().
+ *
+ *  @author Sebastian Mason (sebski123)
+ */
+#include "Arduino.h"
+#include "SWire.h"
+#include "Wire.h"
+#include "device.h"
+#include <algorithm>
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+
+#define FIRST_ADDRESS 1
+#define MASTER_LOOP_US 50  // Time the master's loop takes outside of SWire
+#define DEVICE_LOOP_US 100 // How often each client device runs its loop
+// Each message starts with a key for sendLatest, the time it was queued, its
+// sequence number and its priority
+#define STAMP_KEY 0
+#define STAMP_TIME 1
+#define STAMP_SEQ 5
+#define STAMP_PRIORITY 6
+#define STAMP_LEN 7
+#define MAX_TOPICS 16
+#define ATTENTION_PIN 2
+#define BROADCAST_MARK 0xFF // In place of the priority of a broadcast message
+#define STUCK_SDA_MS 200    // Time between the first client grabbing SDA
+#define STUCK_SDA_CLOCKS 5  // SCL pulses it takes to let go again
+#define DRAIN_MS 1000       // Longest the queues get to empty after a run
+
+// Faults injected on the first client once the run starts
+enum
+{
+  FAULT_NONE,
+  FAULT_HUNG,     // Holds the clock on every callback, for MOCK_HANG_US
+  FAULT_STUCK_SDA // Holds SDA low every STUCK_SDA_MS
+};
+
+simDevice_t simDevices[SIM_DEVICES];
+
+typedef struct {
+  const char *name;
+  uint8_t clients;
+  uint32_t clock_hz;
+  double bit_error_rate;
+  uint32_t stretch_us;
+  uint16_t rate;    // Messages per second per client, 0 to keep queues full
+  uint16_t alarm_ms; // Time between each client's alarms, 0 for none
+  bool downlink;    // Whether the master writes to every client as well
+  bool attention;   // Whether the clients raise an attention line
+  uint8_t payload;  // Message length in bytes
+  uint32_t time_ms; // Simulated run time
+  uint16_t broadcast_ms; // Time between broadcasts to every client, 0 for none
+  uint32_t stream_bytes; // Length of the streams sent to the first client
+                         // one after the other, 0 for none
+  uint32_t wake_us; // Start up time of clients that sleep between loops,
+                    // 0 for clients that stay awake
+  uint8_t fault;    // One of the FAULT_ values
+  bool handlers;    // Whether the master takes messages with onMessage
+  uint8_t topics;   // Keys the clients cycle through with sendLatest, 0 to
+                    // use sendData
+  bool compress;    // Whether the clients delta encode their messages
+} scenario_t;
+
+static const scenario_t _suite[] = {
+    {"1 client", 1, 100000, 0, 0, 0, 0, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"2 clients", 2, 100000, 0, 0, 0, 0, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 clients", 4, 100000, 0, 0, 0, 0, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"8 clients", 8, 100000, 0, 0, 0, 0, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 @ 400k", 4, 400000, 0, 0, 0, 0, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 @ 1M", 4, 1000000, 0, 0, 0, 0, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 duplex", 4, 400000, 0, 0, 0, 0, true, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 full msg", 4, 400000, 0, 0, 0, 0, false, false, MAX_MSG_LEN, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 @ 50/s", 4, 400000, 0, 0, 50, 0, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 @ 5/s", 4, 100000, 0, 0, 5, 0, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 @ 5/s gpio", 4, 100000, 0, 0, 5, 0, false, true, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 broadcast", 4, 100000, 0, 0, 50, 0, false, false, 8, 2000, 10, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 alarms", 4, 100000, 0, 0, 0, 50, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"8 alarms", 8, 100000, 0, 0, 0, 50, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"8 alarm gpio", 8, 100000, 0, 0, 0, 50, false, true, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 stretch", 4, 400000, 0, 200, 50, 0, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 BER 1e-4", 4, 400000, 1e-4, 0, 50, 0, true, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 BER 1e-3", 4, 400000, 1e-3, 0, 50, 0, true, false, 8, 2000, 0, 0, 0, FAULT_NONE, false, 0, false},
+    {"4 bcast BER", 4, 400000, 1e-4, 0, 50, 0, false, false, 8, 2000, 10, 0, 0, FAULT_NONE, false, 0, false},
+    {"stream", 1, 100000, 0, 0, 1, 0, false, false, 8, 2000, 0, 4096, 0, FAULT_NONE, false, 0, false},
+    {"stream @ 1M", 1, 1000000, 0, 0, 1, 0, false, false, 8, 2000, 0, 4096, 0, FAULT_NONE, false, 0, false},
+    {"stream + 4", 4, 400000, 0, 0, 50, 0, false, false, 8, 2000, 0, 4096, 0, FAULT_NONE, false, 0, false},
+    {"stream BER", 1, 400000, 1e-4, 0, 1, 0, false, false, 8, 2000, 0, 4096, 0, FAULT_NONE, false, 0, false},
+    {"4 sleep", 4, 100000, 0, 0, 5, 0, false, false, 8, 2000, 0, 0, 1000, FAULT_NONE, false, 0, false},
+    {"4 sleep gpio", 4, 100000, 0, 0, 5, 0, false, true, 8, 2000, 0, 0, 1000, FAULT_NONE, false, 0, false},
+    {"4 one hung", 4, 400000, 0, 0, 50, 0, true, false, 8, 2000, 0, 0, 0, FAULT_HUNG, false, 0, false},
+    {"4 stuck SDA", 4, 400000, 0, 0, 50, 0, true, false, 8, 2000, 0, 0, 0, FAULT_STUCK_SDA, false, 0, false},
+    {"8 handlers", 8, 100000, 0, 0, 0, 0, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, true, 0, false},
+    {"4 @ 1M hndlr", 4, 1000000, 0, 0, 0, 0, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, true, 0, false},
+    {"8 @ 200/s", 8, 100000, 0, 0, 200, 0, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, true, 0, false},
+    {"8 @ 200/s key", 8, 100000, 0, 0, 200, 0, false, false, 8, 2000, 0, 0, 0, FAULT_NONE, true, 4, false},
+    {"4 full 100k", 4, 100000, 0, 0, 0, 0, false, false, MAX_MSG_LEN, 2000, 0, 0, 0, FAULT_NONE, true, 0, false},
+    {"4 full delta", 4, 100000, 0, 0, 0, 0, false, false, MAX_MSG_LEN, 2000, 0, 0, 0, FAULT_NONE, true, 0, true},
+    {"8 @ 200/s dlt", 8, 100000, 0, 0, 200, 0, false, false, MAX_MSG_LEN, 2000, 0, 0, 0, FAULT_NONE, true, 0, true},
+    {"4 delta BER", 4, 400000, 1e-4, 0, 50, 0, true, false, MAX_MSG_LEN, 2000, 0, 0, 0, FAULT_NONE, false, 0, true},
+};
+
+/** @brief What the harness tracks for one client device */
+typedef struct {
+  simDevice_t *device;
+  uint64_t next_loop;
+  uint64_t next_send;
+  uint64_t next_alarm;
+  uint8_t up_seq;     // Sequence number of the device's next message
+  uint8_t up_expect;  // The one the master expects next
+  uint8_t alarm_seq;  // Likewise for its alarms
+  uint8_t alarm_expect;
+  uint8_t down_seq;   // Likewise for the master's messages to it
+  uint8_t down_expect;
+  uint8_t broadcast_expect; // And for the master's broadcasts
+  uint8_t topic_seq[MAX_TOPICS]; // With sendLatest, likewise for each key, so
+  uint8_t topic_expect[MAX_TOPICS]; // gaps are the values superseded
+  uint32_t up_sent;
+  uint32_t up_received;
+  uint32_t alarms_received;
+  uint32_t down_sent;
+  uint32_t down_received;
+  uint32_t gaps;
+  uint32_t repeats; // Messages, to it or from it, that arrived again
+} simClient_t;
+
+static const scenario_t *_scenario;
+static simClient_t _clients[SIM_DEVICES];
+static std::vector<uint32_t> _latencies;
+static uint32_t _alarm_latency_max;
+static uint32_t _broadcast_latency_max;
+static uint32_t _stream_errors; // Streamed bytes that arrived wrong
+static uint32_t _corrupt;       // Messages to the master that arrived wrong
+static bool _in_devices = false;
+static bool _draining = false; // Whether the devices have stopped sending
+static bool _tracing = false;
+
+/** @brief Fills a message with key 0, its timestamp, sequence number and
+ *         padding
+ */
+static void stampMessage(uint8_t *message, uint8_t length, uint8_t seq, uint8_t priority,
+                         uint8_t address)
+{
+  uint32_t now = (uint32_t)mockMicros();
+  message[STAMP_KEY] = 0;
+  memcpy(message + STAMP_TIME, &now, sizeof(now));
+  message[STAMP_SEQ] = seq;
+  message[STAMP_PRIORITY] = priority;
+  memset(message + STAMP_LEN, address, length - STAMP_LEN);
+}
+
+/** @brief The byte at an offset of every stream */
+static uint8_t streamByte(uint32_t offset)
+{
+  return (uint8_t)(offset * 31 + (offset >> 8));
+}
+
+static bool streamSource(uint32_t offset, uint8_t *data, uint8_t length, void *context)
+{
+  (void)context;
+  for (uint8_t i = 0; i < length; i++)
+  {
+    data[i] = streamByte(offset + i);
+  }
+  return true;
+}
+
+static bool streamSink(uint32_t offset, const uint8_t *data, uint8_t length, void *context)
+{
+  (void)context;
+  for (uint8_t i = 0; i < length; i++)
+  {
+    _stream_errors += (data[i] != streamByte(offset + i));
+  }
+  return true;
+}
+
+/** @brief Counts the messages a sequence number shows were never received,
+ *         or were received before
+ *
+ *  @return Whether the message is a new one, rather than a repeat
+ */
+static bool checkSequence(uint8_t seq, uint8_t *expect, simClient_t *client)
+{
+  uint8_t skipped = seq - *expect;
+  if (skipped >= 128)
+  {
+    client->repeats++; // Older than the last one received
+    return false;
+  }
+  client->gaps += skipped;
+  *expect = seq + 1;
+  return true;
+}
+
+static const char *const _phase_names[] = {"send", "request", "poll", "write",
+                                           "scan", "receive isr", "request isr"};
+#define TRACE_PHASES (sizeof(_phase_names) / sizeof(_phase_names[0]))
+
+/** @brief Totals the events of every swireTraceDump printed to it */
+class TraceSummary : public Print
+{
+public:
+  uint32_t count[TRACE_PHASES];
+  uint64_t total_us[TRACE_PHASES];
+  uint32_t max_us[TRACE_PHASES];
+  uint32_t lost;
+
+  void clear()
+  {
+    memset(count, 0, sizeof(count));
+    memset(total_us, 0, sizeof(total_us));
+    memset(max_us, 0, sizeof(max_us));
+    lost = 0;
+    _length = 0;
+  }
+
+  size_t write(uint8_t c) override
+  {
+    if (c == '\n')
+    {
+      _line[_length] = '\0';
+      takeLine();
+      _length = 0;
+    }
+    else if (c != '\r' && _length < sizeof(_line) - 1)
+    {
+      _line[_length++] = c;
+    }
+    return 1;
+  }
+
+private:
+  char _line[64];
+  size_t _length;
+
+  void takeLine()
+  {
+    unsigned long time_us, duration_us;
+    unsigned phase, address, bytes;
+    int result;
+    unsigned long lost_events;
+    if (sscanf(_line, "# lost %lu", &lost_events) == 1)
+    {
+      lost += lost_events;
+    }
+    else if (sscanf(_line, "%lu,%lu,%u,%u,%u,%d", &time_us, &duration_us, &phase, &address,
+                    &bytes, &result) == 6 &&
+             phase < TRACE_PHASES)
+    {
+      count[phase]++;
+      total_us[phase] += duration_us;
+      max_us[phase] = std::max(max_us[phase], (uint32_t)duration_us);
+    }
+  }
+};
+
+static TraceSummary _trace_summary;
+
+/** @brief Moves the master's and every client's trace into _trace_summary
+ *
+ *  Called often enough that the rings, TRACE_DEPTH deep, seldom fill up
+ *  between calls. Whatever they lost shows up in the summary.
+ */
+static void collectTraces()
+{
+#if ENABLE_TRACE
+  swireTraceDump(_trace_summary);
+  swireTraceClear();
+  for (uint8_t i = 0; i < _scenario->clients; i++)
+  {
+    simDevices[i].traceDump(_trace_summary);
+    simDevices[i].traceClear();
+  }
+#endif
+}
+
+/** @brief Gets the master's counters, all 0 without ENABLE_STATS */
+static const swireStats_t *masterStats(SWireMaster *master)
+{
+#if ENABLE_STATS
+  return master->getStats();
+#else
+  static const swireStats_t none = swireStats_t();
+  (void)master;
+  return &none;
+#endif
+}
+
+/** @brief Prints the summary of the run's trace */
+static void printTraceSummary()
+{
+  for (size_t i = 0; i < TRACE_PHASES; i++)
+  {
+    if (_trace_summary.count[i] > 0)
+    {
+      printf("  %-12s %8u events, mean %6.1f us, max %6u us\n", _phase_names[i],
+             (unsigned)_trace_summary.count[i],
+             (double)_trace_summary.total_us[i] / _trace_summary.count[i],
+             (unsigned)_trace_summary.max_us[i]);
+    }
+  }
+  if (_trace_summary.lost > 0)
+  {
+    printf("  %u trace events lost\n", (unsigned)_trace_summary.lost);
+  }
+}
+
+/** @brief Runs the loop of every device that is due
+ *
+ *  Called from the master's loop and before every bus transaction, so the
+ *  devices keep up with the simulated clock while the master is busy.
+ */
+static void runDevices()
+{
+  if (_in_devices)
+  {
+    return;
+  }
+  if (_tracing)
+  {
+    collectTraces();
+  }
+  _in_devices = true;
+  uint64_t now = mockMicros();
+  for (uint8_t i = 0; i < _scenario->clients; i++)
+  {
+    simClient_t *client = &_clients[i];
+    simDevice_t *device = client->device;
+    if (client->next_loop > now)
+    {
+      continue;
+    }
+    if (device->wire->asleep)
+    {
+      // Only the bus or its timer wakes it, the timer when it has a message
+      // to send
+      if ((_scenario->rate > 0 && client->next_send > now) &&
+          (_scenario->alarm_ms == 0 || client->next_alarm > now))
+      {
+        continue;
+      }
+      device->wire->wake();
+    }
+    client->next_loop = now + DEVICE_LOOP_US;
+    uint8_t message[MSG_LEN_LIMIT];
+
+    device->service();
+    while (device->getData(message, sizeof(message)) > 0)
+    {
+      if (message[STAMP_PRIORITY] == BROADCAST_MARK)
+      {
+        uint32_t stamp;
+        memcpy(&stamp, message + STAMP_TIME, sizeof(stamp));
+        if (checkSequence(message[STAMP_SEQ], &client->broadcast_expect, client))
+        {
+          _broadcast_latency_max =
+              std::max(_broadcast_latency_max, (uint32_t)mockMicros() - stamp);
+        }
+      }
+      else if (checkSequence(message[STAMP_SEQ], &client->down_expect, client))
+      {
+        client->down_received++;
+      }
+    }
+    if (_draining)
+    {
+      continue;
+    }
+    if (_scenario->alarm_ms > 0 && client->next_alarm <= now)
+    {
+      stampMessage(message, _scenario->payload, client->alarm_seq, PRIORITY_URGENT,
+                   FIRST_ADDRESS + i);
+      if (device->sendData(message, _scenario->payload, PRIORITY_URGENT))
+      {
+        client->alarm_seq++;
+        client->next_alarm += (uint64_t)_scenario->alarm_ms * 1000;
+      }
+    }
+    while (_scenario->rate == 0 || client->next_send <= now)
+    {
+      stampMessage(message, _scenario->payload, client->up_seq, PRIORITY_NORMAL,
+                   FIRST_ADDRESS + i);
+      uint8_t topic = client->up_seq % (_scenario->topics > 0 ? _scenario->topics : 1);
+      if (_scenario->topics > 0)
+      {
+        message[STAMP_KEY] = topic;
+        message[STAMP_SEQ] = client->topic_seq[topic];
+      }
+      if (!(_scenario->topics > 0 ? device->sendLatest : device->sendData)(
+              message, _scenario->payload, PRIORITY_NORMAL))
+      {
+        break;
+      }
+      client->topic_seq[topic]++;
+      client->up_seq++;
+      client->up_sent++;
+      if (_scenario->rate > 0)
+      {
+        client->next_send += 1000000 / _scenario->rate;
+      }
+    }
+    if (_scenario->wake_us > 0)
+    {
+      device->sleep();
+    }
+  }
+  _in_devices = false;
+}
+
+/** @brief Checks and times one message the master received
+ *
+ *  An onMessage handler, and called by drainMaster for each message it
+ *  takes.
+ */
+static void takeMessage(uint8_t client_id, const uint8_t *message, uint8_t length,
+                        void *context)
+{
+  (void)context;
+  uint8_t index = client_id - FIRST_ADDRESS;
+  if (index >= _scenario->clients)
+  {
+    return;
+  }
+  bool intact = (length == _scenario->payload) &&
+                message[STAMP_KEY] < std::max<uint8_t>(_scenario->topics, 1);
+  for (uint8_t i = STAMP_LEN; intact && i < length; i++)
+  {
+    intact = (message[i] == client_id);
+  }
+  if (!intact)
+  {
+    _corrupt++;
+    return;
+  }
+  simClient_t *client = &_clients[index];
+  uint32_t stamp;
+  memcpy(&stamp, message + STAMP_TIME, sizeof(stamp));
+  uint32_t latency = (uint32_t)mockMicros() - stamp;
+  if (message[STAMP_PRIORITY] != PRIORITY_NORMAL)
+  {
+    if (checkSequence(message[STAMP_SEQ], &client->alarm_expect, client))
+    {
+      _alarm_latency_max = std::max(_alarm_latency_max, latency);
+      client->alarms_received++;
+    }
+  }
+  else if (checkSequence(message[STAMP_SEQ],
+                         (_scenario->topics > 0) ? &client->topic_expect[message[STAMP_KEY]]
+                                                 : &client->up_expect,
+                         client))
+  {
+    _latencies.push_back(latency);
+    client->up_received++;
+  }
+}
+
+/** @brief Takes the messages the master has, checking and timing each one
+ *
+ *  getData services the bus each time, so with busy clients there is always
+ *  another message. At most a queue's worth is taken per call, leaving the
+ *  rest of the loop its turn. With handlers, service already took them all.
+ */
+static void drainMaster(SWireMaster *master)
+{
+  uint8_t message[MAX_MSG_LEN];
+  uint8_t client_id;
+  int length;
+
+  for (uint8_t taken = 0;
+       taken < MAX_MASTER_QUEUE_SIZE &&
+       (length = master->getData(message, sizeof(message), &client_id)) > 0;
+       taken++)
+  {
+    takeMessage(client_id, message, length, NULL);
+  }
+}
+
+/** @brief Gets the p-th percentile of the latencies, which must be sorted
+ */
+static uint32_t percentile(uint8_t p)
+{
+  if (_latencies.empty())
+  {
+    return 0;
+  }
+  size_t rank = (_latencies.size() * p + 99) / 100;
+  return _latencies[(rank > 0) ? rank - 1 : 0];
+}
+
+static void printHeader()
+{
+  printf("RAM: SWireMaster %u bytes, SWireClient %u bytes\n\n",
+         (unsigned)sizeof(SWireMaster), (unsigned)simDevices[0].client_size);
+  printf("%-13s %7s %8s %8s %7s %7s %7s %7s %8s %8s %8s %5s %7s %5s %6s %7s\n",
+         "scenario", "clock", "up/s", "down/s", "p50 us", "p90 us", "p99 us", "max us",
+         "alarm us", "bcast us", "strm B/s", "gaps", "retries", "bus%", "sleep%", "wake us");
+}
+
+/** @brief Prints how many messages each client got through, up and down */
+static void printClients(const scenario_t *scenario)
+{
+  if (scenario->clients < 2)
+  {
+    return;
+  }
+  printf("  up per client:");
+  for (uint8_t i = 0; i < scenario->clients; i++)
+  {
+    printf(" %u", (unsigned)(_clients[i].up_received + _clients[i].alarms_received));
+  }
+  if (scenario->downlink)
+  {
+    printf(", down:");
+    for (uint8_t i = 0; i < scenario->clients; i++)
+    {
+      printf(" %u", (unsigned)_clients[i].down_received);
+    }
+  }
+  printf("\n");
+}
+
+/** @brief Prints the queue high-water marks of the master and its busiest client */
+static void printQueues(const scenario_t *scenario, SWireMaster *master)
+{
+  uint8_t client_in = 0, client_out = 0;
+  for (uint8_t i = 0; i < scenario->clients; i++)
+  {
+    client_in = std::max(client_in, simDevices[i].queueHighWater(false));
+    client_out = std::max(client_out, simDevices[i].queueHighWater(true));
+  }
+  printf("  queue high water: master in %u out %u, client in %u out %u\n",
+         (unsigned)master->getQueueHighWater(false), (unsigned)master->getQueueHighWater(true),
+         (unsigned)client_in, (unsigned)client_out);
+}
+
+/** @brief Counts the messages sent that have not arrived
+ *
+ *  With sendLatest only the latest value of each key has to arrive, so
+ *  each key still waiting for it counts as one.
+ */
+static uint32_t undelivered(const scenario_t *scenario)
+{
+  uint32_t missing = 0;
+  for (uint8_t i = 0; i < scenario->clients; i++)
+  {
+    simClient_t *client = &_clients[i];
+    if (scenario->topics > 0)
+    {
+      for (uint8_t key = 0; key < scenario->topics; key++)
+      {
+        missing += (client->topic_expect[key] != client->topic_seq[key]);
+      }
+    }
+    else
+    {
+      missing += client->up_sent - client->up_received;
+    }
+    missing += (uint8_t)(client->alarm_seq - client->alarm_expect);
+    missing += client->down_sent - client->down_received;
+  }
+  return missing;
+}
+
+/** @brief Stops the traffic and runs on until every queue has emptied
+ *
+ *  Gives up after DRAIN_MS, e.g. on a hung client.
+ *
+ *  @return The number of messages that never arrived, see undelivered
+ */
+static uint32_t drain(const scenario_t *scenario, SWireMaster *master)
+{
+  master->cancelStream();
+  _draining = true;
+  uint64_t end = mockMicros() + (uint64_t)DRAIN_MS * 1000;
+  while (undelivered(scenario) > 0 && mockMicros() < end)
+  {
+    master->service();
+    drainMaster(master);
+    runDevices();
+    mockAdvance(MASTER_LOOP_US);
+  }
+  _draining = false;
+  return undelivered(scenario);
+}
+
+/** @brief Runs one scenario from power on and prints its results
+ *
+ *  @return Whether every client was found, every stream and message
+ *          arrived intact, and none arrived twice
+ */
+static bool runScenario(const scenario_t *scenario)
+{
+  _scenario = scenario;
+  _latencies.clear();
+  _alarm_latency_max = 0;
+  _broadcast_latency_max = 0;
+  _stream_errors = 0;
+  _corrupt = 0;
+  memset(_clients, 0, sizeof(_clients));
+  mockBus.bit_error_rate = 0;
+  mockBus.seed = 1;
+  mockBus.on_transaction = runDevices;
+
+  for (uint8_t i = 0; i < scenario->clients; i++)
+  {
+    _clients[i].device = &simDevices[i];
+    _clients[i].next_send = UINT64_MAX; // Not until the run starts
+    _clients[i].next_alarm = UINT64_MAX;
+    simDevices[i].wire->stretch_us = scenario->stretch_us;
+    simDevices[i].wire->wake_us = scenario->wake_us;
+    simDevices[i].powerOn(FIRST_ADDRESS + i,
+                          scenario->attention ? ATTENTION_PIN : NO_ATTENTION_PIN);
+    simDevices[i].setCompression(scenario->compress);
+  }
+  if (scenario->stream_bytes > 0)
+  {
+    simDevices[0].receiveStream(streamSink, NULL);
+  }
+  SWireMaster *master = new SWireMaster(Wire);
+  master->setBusClock(scenario->clock_hz);
+  if (scenario->attention)
+  {
+    master->setAttentionPin(ATTENTION_PIN);
+  }
+  if (scenario->handlers)
+  {
+    master->onMessage(takeMessage, NULL);
+  }
+  int found = master->identifyClients();
+
+  // Everything from here on is measured
+  if (scenario->fault == FAULT_HUNG)
+  {
+    simDevices[0].wire->stretch_us = MOCK_HANG_US;
+  }
+  mockBus.bit_error_rate = scenario->bit_error_rate;
+  mockBusClearCounters();
+#if ENABLE_STATS
+  master->resetStats();
+#endif
+  if (_tracing)
+  {
+    collectTraces(); // Dropping what setup traced
+    _trace_summary.clear();
+  }
+  uint64_t start = mockMicros();
+  for (uint8_t i = 0; i < scenario->clients; i++)
+  {
+    _clients[i].next_send = start;
+    _clients[i].next_alarm = start + (uint64_t)scenario->alarm_ms * 1000;
+    simDevices[i].wire->slept_us = 0;
+    simDevices[i].wire->asleep_since = start;
+  }
+  uint64_t end = start + (uint64_t)scenario->time_ms * 1000;
+  uint8_t next_down = 0;
+  uint64_t next_broadcast = start;
+  uint64_t next_stuck = start;
+  uint8_t broadcast_seq = 0;
+  uint32_t streamed = 0;
+  uint32_t stream_failures = 0;
+  bool streaming = false;
+
+  while (mockMicros() < end)
+  {
+    master->service();
+    drainMaster(master);
+    for (uint8_t i = 0; scenario->downlink && i < scenario->clients; i++)
+    {
+      simClient_t *client = &_clients[next_down];
+      uint8_t message[MAX_MSG_LEN];
+      uint8_t address = FIRST_ADDRESS + next_down;
+      stampMessage(message, scenario->payload, client->down_seq, PRIORITY_NORMAL, address);
+      if (master->sendData(address, message, scenario->payload))
+      {
+        client->down_seq++;
+        client->down_sent++;
+      }
+      else if (!master->isQuarantined(address))
+      {
+        break; // Its turn again once there is room, or the others crowd it out
+      }
+      next_down = (next_down + 1) % scenario->clients;
+    }
+    if (scenario->broadcast_ms > 0 && next_broadcast <= mockMicros())
+    {
+      uint8_t message[MAX_MSG_LEN];
+      stampMessage(message, scenario->payload, broadcast_seq++, BROADCAST_MARK, 0);
+      master->broadcastData(BROADCAST_ALL, message, scenario->payload);
+      next_broadcast += (uint64_t)scenario->broadcast_ms * 1000;
+    }
+    if (scenario->stream_bytes > 0 && master->streamStatus(NULL) != 1)
+    {
+      if (streaming && master->streamStatus(NULL) == 0)
+      {
+        streamed += scenario->stream_bytes;
+      }
+      else if (streaming)
+      {
+        stream_failures++;
+      }
+      streaming = master->beginStream(FIRST_ADDRESS, scenario->stream_bytes, streamSource, NULL);
+    }
+    if (scenario->fault == FAULT_STUCK_SDA && next_stuck <= mockMicros())
+    {
+      mockBusHoldSda(simDevices[0].wire, STUCK_SDA_CLOCKS);
+      next_stuck += (uint64_t)STUCK_SDA_MS * 1000;
+    }
+    runDevices();
+    mockAdvance(MASTER_LOOP_US);
+  }
+  double seconds = (mockMicros() - start) / 1e6;
+  uint32_t acknowledged = 0;
+  if (master->streamStatus(&acknowledged) == 1)
+  {
+    streamed += acknowledged;
+  }
+
+  uint32_t up = 0, down = 0, gaps = 0, wake_max = 0;
+  uint64_t slept = 0;
+  for (uint8_t i = 0; i < scenario->clients; i++)
+  {
+    TwoWire *wire = simDevices[i].wire;
+    up += _clients[i].up_received;
+    down += _clients[i].down_received;
+    gaps += _clients[i].gaps;
+    wire->wake(); // Counting the sleep it is in
+    slept += wire->slept_us;
+    wake_max = std::max(wake_max, simDevices[i].wakeLatency());
+  }
+  std::sort(_latencies.begin(), _latencies.end());
+  printf("%-13s %7u %8.0f %8.0f %7u %7u %7u %7u %8u %8u %8.0f %5u %7u %5.1f %6.1f %7u\n",
+         scenario->name, (unsigned)master->getBusClock(), up / seconds, down / seconds,
+         (unsigned)percentile(50), (unsigned)percentile(90), (unsigned)percentile(99),
+         (unsigned)percentile(100), (unsigned)_alarm_latency_max,
+         (unsigned)_broadcast_latency_max, streamed / seconds, (unsigned)gaps,
+         (unsigned)masterStats(master)->retries,
+         100.0 * mockBus.busy_us / (mockMicros() - start),
+         100.0 * slept / scenario->clients / (mockMicros() - start), (unsigned)wake_max);
+  printClients(scenario);
+  printQueues(scenario, master);
+
+  if (scenario->fault != FAULT_NONE)
+  {
+    const swireStats_t *stats = masterStats(master);
+    printf("  %u timeouts, %u bus recoveries, %u quarantines, %u writes dropped\n",
+           (unsigned)stats->timeouts, (unsigned)stats->recoveries,
+           (unsigned)stats->quarantines, (unsigned)stats->dropped);
+    mockBusHoldSda(simDevices[0].wire, 0);
+  }
+  if (scenario->compress)
+  {
+    const swireStats_t *stats = masterStats(master);
+    printf("  %u message bytes sent, %u saved by delta encoding (%.1f%%)\n",
+           (unsigned)stats->payload_bytes, (unsigned)stats->delta_saved,
+           100.0 * stats->delta_saved / (stats->payload_bytes + stats->delta_saved));
+  }
+  if (_tracing)
+  {
+    collectTraces();
+    printTraceSummary();
+  }
+  uint32_t lost = drain(scenario, master);
+  uint32_t repeats = 0;
+  for (uint8_t i = 0; i < scenario->clients; i++)
+  {
+    repeats += _clients[i].repeats;
+  }
+  mockBus.on_transaction = NULL;
+  delete master;
+  for (uint8_t i = 0; i < scenario->clients; i++)
+  {
+    simDevices[i].powerOff();
+  }
+  if (stream_failures > 0 || _stream_errors > 0)
+  {
+    printf("  %u streams failed, %u bytes streamed wrong\n", (unsigned)stream_failures,
+           (unsigned)_stream_errors);
+  }
+  if (_corrupt > 0)
+  {
+    printf("  %u messages arrived corrupt\n", (unsigned)_corrupt);
+  }
+  if (lost > 0 || repeats > 0)
+  {
+    printf("  %u messages never arrived, %u arrived more than once\n", (unsigned)lost,
+           (unsigned)repeats);
+  }
+  if (found != scenario->clients)
+  {
+    printf("  found %d of %u clients\n", found, (unsigned)scenario->clients);
+    return false;
+  }
+  return _stream_errors == 0 && _corrupt == 0 && repeats == 0;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [-c clients] [-k clock_hz] [-e bit_error_rate] [-s stretch_us]\n"
+          "          [-r msgs_per_s] [-a alarm_ms] [-b broadcast_ms] [-x stream_bytes]\n"
+          "          [-p payload] [-t ms] [-w wake_us] [-f fault] [-l topics] [-d] [-g] [-m]\n"
+          "          [-z] [-T]\n"
+          "Runs the default suite without options.\n"
+          "  -c  clients, 1 to %d (default 4)\n"
+          "  -k  bus clock to ask for (default 100000)\n"
+          "  -e  probability of each bit flipping (default 0)\n"
+          "  -s  clock stretch per slave callback (default 0)\n"
+          "  -r  messages per second per client, 0 for as many as fit (default 0)\n"
+          "  -a  time between urgent alarms from each client, 0 for none (default 0)\n"
+          "  -b  time between broadcasts to every client, 0 for none (default 0)\n"
+          "  -x  stream this many bytes to the first client, over and over (default 0)\n"
+          "  -p  message length, %d to %d (default 8)\n"
+          "  -t  simulated run time (default 2000)\n"
+          "  -w  have the clients sleep between loops, taking this long to wake up\n"
+          "      (default 0, for no sleep)\n"
+          "  -f  fault on the first client: 1 hangs holding the clock, 2 holds SDA\n"
+          "      low every %d ms (default 0, for none)\n"
+          "  -l  have the clients send the latest value of this many keys with\n"
+          "      sendLatest, 1 to %d, needs -r (default 0, for sendData)\n"
+          "  -d  have the master write to every client as well\n"
+          "  -g  have the clients raise an attention line\n"
+          "  -m  have the master take messages with onMessage rather than getData\n"
+          "  -z  have the clients delta encode their messages\n"
+          "  -T  print a summary of the trace, needs ENABLE_TRACE in SWire.h\n",
+          name, SIM_DEVICES, STAMP_LEN, MAX_MSG_LEN, STUCK_SDA_MS, MAX_TOPICS);
+}
+
+int main(int argc, char **argv)
+{
+  scenario_t custom = {"custom", 4, 100000, 0, 0, 0, 0, false, false, 8, 2000, 0, 0, 0,
+                       FAULT_NONE, false, 0, false};
+  bool single = false;
+  int option;
+
+  while ((option = getopt(argc, argv, "c:k:e:s:r:a:b:x:p:t:w:f:l:dgmzTh")) != -1)
+  {
+    single = single || option != 'T'; // Tracing alone still runs the suite
+    switch (option)
+    {
+    case 'c':
+      custom.clients = atoi(optarg);
+      break;
+    case 'k':
+      custom.clock_hz = strtoul(optarg, NULL, 0);
+      break;
+    case 'e':
+      custom.bit_error_rate = atof(optarg);
+      break;
+    case 's':
+      custom.stretch_us = strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      custom.rate = atoi(optarg);
+      break;
+    case 'a':
+      custom.alarm_ms = atoi(optarg);
+      break;
+    case 'b':
+      custom.broadcast_ms = atoi(optarg);
+      break;
+    case 'x':
+      custom.stream_bytes = strtoul(optarg, NULL, 0);
+      break;
+    case 'p':
+      custom.payload = atoi(optarg);
+      break;
+    case 't':
+      custom.time_ms = strtoul(optarg, NULL, 0);
+      break;
+    case 'w':
+      custom.wake_us = strtoul(optarg, NULL, 0);
+      break;
+    case 'f':
+      custom.fault = atoi(optarg);
+      break;
+    case 'l':
+      custom.topics = atoi(optarg);
+      break;
+    case 'd':
+      custom.downlink = true;
+      break;
+    case 'g':
+      custom.attention = true;
+      break;
+    case 'm':
+      custom.handlers = true;
+      break;
+    case 'z':
+      custom.compress = true;
+      break;
+    case 'T':
+#if ENABLE_TRACE
+      _tracing = true;
+      break;
+#else
+      fprintf(stderr, "%s: -T needs ENABLE_TRACE set in SWire.h\n", argv[0]);
+      return 2;
+#endif
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (custom.clients < 1 || custom.clients > SIM_DEVICES ||
+      custom.payload < STAMP_LEN || custom.payload > MAX_MSG_LEN || custom.clock_hz == 0 ||
+      custom.fault > FAULT_STUCK_SDA || custom.topics > MAX_TOPICS ||
+      (custom.topics > 0 && custom.rate == 0))
+  {
+    usage(argv[0]);
+    return 2;
+  }
+
+  printHeader();
+  if (single)
+  {
+    return runScenario(&custom) ? 0 : 1;
+  }
+  bool passed = true;
+  for (size_t i = 0; i < sizeof(_suite) / sizeof(_suite[0]); i++)
+  {
+    passed = runScenario(&_suite[i]) && passed;
+  }
+  return passed ? 0 : 1;
+}
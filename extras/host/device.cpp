@@ -0,0 +1,145 @@
+/** @file device.cpp
+ *  @brief One simulated client device, see device.h.
+ *
+ *  Built once per device with SIM_DEVICE_INDEX set to its slot in
+ *  simDevices and SIM_DEVICE_NAMESPACE to a name unique to it.
+ *
+ *  @author Sebastian Mason (sebski123)
+ */
+#include "Arduino.h"
+#include "Wire.h"
+#include "crc8.h"
+#include "deltaCodec.h"
+#include <avr/sleep.h>
+#include "device.h"
+#include "messageQueue.h"
+#include <new>
+
+namespace SIM_DEVICE_NAMESPACE
+{
+#include "SWire.cpp"
+
+static TwoWire _wire;
+alignas(SWireClient) static uint8_t _storage[sizeof(SWireClient)];
+static SWireClient *_client = NULL;
+
+/** @brief Starts the device's firmware with a client at an address
+ */
+static void powerOn(uint8_t address, uint8_t attention_pin)
+{
+  _client = new (_storage) SWireClient(address, _wire);
+  _client->setAttentionPin(attention_pin);
+}
+
+/** @brief Stops the device, leaving the bus and forgetting all state
+ */
+static void powerOff()
+{
+  if (_client)
+  {
+    _client->setAttentionPin(NO_ATTENTION_PIN);
+  }
+  _wire.end();
+  _client = NULL;
+  memset(_client_instances, 0, sizeof(_client_instances)); // Globals too
+}
+
+static void setCompression(bool enable)
+{
+  if (_client)
+  {
+    _client->setCompression(enable);
+  }
+}
+
+static int sendData(const uint8_t *data, size_t length, uint8_t priority)
+{
+  return _client ? _client->sendData(data, length, priority) : 0;
+}
+
+static int sendLatest(const uint8_t *data, size_t length, uint8_t priority)
+{
+  return _client ? _client->sendLatest(data, length, priority) : 0;
+}
+
+static int getData(uint8_t *buffer, size_t size)
+{
+  return _client ? _client->getData(buffer, size) : 0;
+}
+
+static void service()
+{
+  if (_client)
+  {
+    _client->service();
+  }
+}
+
+static int receiveStream(swireStreamSink_t sink, void *context)
+{
+  return _client ? _client->receiveStream(sink, context) : 0;
+}
+
+static int sleep()
+{
+  if (_client && _client->sleep())
+  {
+    _wire.sleep();
+    return 1;
+  }
+  return 0;
+}
+
+static uint32_t wakeLatency()
+{
+#if ENABLE_STATS
+  return _client ? _client->getStats()->latency_max_us : 0;
+#else
+  return 0;
+#endif
+}
+
+static uint8_t queueHighWater(bool outgoing)
+{
+  return _client ? _client->getQueueHighWater(outgoing) : 0;
+}
+
+static void traceDump(Print &out)
+{
+#if ENABLE_TRACE
+  swireTraceDump(out);
+#else
+  (void)out;
+#endif
+}
+
+static void traceClear()
+{
+#if ENABLE_TRACE
+  swireTraceClear();
+#endif
+}
+
+static struct registration_t
+{
+  registration_t()
+  {
+    simDevice_t *device = &simDevices[SIM_DEVICE_INDEX];
+    device->wire = &_wire;
+    device->client_size = sizeof(SWireClient);
+    device->powerOn = powerOn;
+    device->powerOff = powerOff;
+    device->setCompression = setCompression;
+    device->sendData = sendData;
+    device->sendLatest = sendLatest;
+    device->getData = getData;
+    device->service = service;
+    device->receiveStream = receiveStream;
+    device->sleep = sleep;
+    device->wakeLatency = wakeLatency;
+    device->queueHighWater = queueHighWater;
+    device->traceDump = traceDump;
+    device->traceClear = traceClear;
+  }
+} _registration;
+} // namespace SIM_DEVICE_NAMESPACE
@@ -0,0 +1,40 @@
+/** @file device.h
+ *  @brief Simulated client devices for the host harness.
+ *
+ *  Each device is a separate microcontroller on the bus: device.cpp is
+ *  compiled once per device into its own namespace, so every device gets a
+ *  private copy of the library, its globals and its ISR trampolines, just as
+ *  if it had been flashed with its own firmware. The copies register
+ *  themselves in simDevices at start up.
+ *
+ *  @author Sebastian Mason (sebski123)
+ */
+#pragma once
+#include "Wire.h"
+
+#ifndef SIM_DEVICES
+#define SIM_DEVICES 8
+#endif
+
+typedef struct {
+  TwoWire *wire; // The device's own I2C peripheral
+  size_t client_size; // sizeof the SWireClient it runs
+  void (*powerOn)(uint8_t address, uint8_t attention_pin);
+  void (*powerOff)();
+  void (*setCompression)(bool enable);
+  int (*sendData)(const uint8_t *data, size_t length, uint8_t priority);
+  int (*sendLatest)(const uint8_t *data, size_t length, uint8_t priority);
+  int (*getData)(uint8_t *buffer, size_t size);
+  void (*service)();
+  int (*receiveStream)(bool (*sink)(uint32_t offset, const uint8_t *data, uint8_t length,
+                                    void *context),
+                       void *context);
+  int (*sleep)(); // Sleeps the client, marking wire asleep if it did
+  uint32_t (*wakeLatency)(); // The client's longest wake-to-reply time
+  uint8_t (*queueHighWater)(bool outgoing); // getQueueHighWater, normal lane
+  void (*traceDump)(Print &out); // swireTraceDump of the device's own trace,
+                                 // nothing without ENABLE_TRACE
+  void (*traceClear)();          // swireTraceClear, likewise
+} simDevice_t;
+
+extern simDevice_t simDevices[SIM_DEVICES];
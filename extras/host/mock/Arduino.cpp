@@ -0,0 +1,147 @@
+/** @file Arduino.cpp
+ *  @brief Simulated clock and pins for the host build.
+ *
+ *  Each pin is one open-drain net shared by every simulated device, pulled
+ *  up. A device pulls it low by writing LOW and switching the pin to
+ *  OUTPUT, and lets go by switching it back to INPUT; the net reads LOW
+ *  while any device pulls it. INPUT_PULLUP only listens. Since the mock can't tell devices apart, each
+ *  must only let go of a pin it is pulling.
+ *
+ *  @author Sebastian Mason (sebski123)
+ */
+#include "Arduino.h"
+#include <stdio.h>
+
+#define MOCK_PINS 64
+
+static uint64_t _now_us = 0;
+static bool _pin_latch_low[MOCK_PINS]; // Level last written
+static uint8_t _pin_pulls[MOCK_PINS];   // Devices pulling the net low
+void (*mockOnPinChange)(uint8_t pin, int level) = NULL;
+
+/** @brief Adds or takes away one device pulling a net low, reporting the
+ *         net's level when it changes
+ */
+static void pull(uint8_t pin, bool low)
+{
+  if (!low && _pin_pulls[pin] == 0)
+  {
+    return;
+  }
+  _pin_pulls[pin] += low ? 1 : -1;
+  if (mockOnPinChange && _pin_pulls[pin] == (low ? 1 : 0))
+  {
+    mockOnPinChange(pin, low ? LOW : HIGH);
+  }
+}
+
+unsigned long millis()
+{
+  return (unsigned long)(_now_us / 1000);
+}
+
+unsigned long micros()
+{
+  return (unsigned long)_now_us;
+}
+
+void delay(unsigned long ms)
+{
+  _now_us += (uint64_t)ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  _now_us += us;
+}
+
+uint64_t mockMicros()
+{
+  return _now_us;
+}
+
+void mockAdvance(uint64_t us)
+{
+  _now_us += us;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  if (pin >= MOCK_PINS)
+  {
+    return;
+  }
+  if (mode == OUTPUT)
+  {
+    if (_pin_latch_low[pin])
+    {
+      pull(pin, true);
+    }
+  }
+  else if (mode == INPUT)
+  {
+    pull(pin, false);
+  }
+}
+
+void mockHoldPin(uint8_t pin, bool low)
+{
+  if (pin < MOCK_PINS)
+  {
+    pull(pin, low);
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  if (pin < MOCK_PINS)
+  {
+    _pin_latch_low[pin] = (value == LOW);
+  }
+}
+
+int digitalRead(uint8_t pin)
+{
+  return (pin < MOCK_PINS && _pin_pulls[pin] > 0) ? LOW : HIGH;
+}
+
+MockSerial Serial;
+
+size_t MockSerial::write(uint8_t c)
+{
+  return putchar(c) == EOF ? 0 : 1;
+}
+
+size_t Print::print(const char *text)
+{
+  size_t written = 0;
+  while (*text)
+  {
+    written += write((uint8_t)*text++);
+  }
+  return written;
+}
+
+size_t Print::print(char c)
+{
+  return write((uint8_t)c);
+}
+
+size_t Print::print(unsigned long n)
+{
+  char text[24];
+  snprintf(text, sizeof(text), "%lu", n);
+  return print(text);
+}
+
+size_t Print::print(long n)
+{
+  char text[24];
+  snprintf(text, sizeof(text), "%ld", n);
+  return print(text);
+}
+
+size_t Print::println()
+{
+  return print("\r\n");
+}
@@ -0,0 +1,75 @@
+/** @file Arduino.h
+ *  @brief Host stand-in for the parts of the Arduino core SWire uses.
+ *
+ *  Time is simulated: millis and micros report a clock that only moves when
+ *  delay or delayMicroseconds is called, or when the mock bus in Wire.h
+ *  clocks bytes. Runs are therefore reproducible and independent of the
+ *  speed of the host.
+ *
+ *  @author Sebastian Mason (sebski123)
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+// Wire's pins, as on an Uno
+#define PIN_WIRE_SDA 18
+#define PIN_WIRE_SCL 19
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// Interrupts can't preempt anything on the host, callbacks run in line
+static inline void noInterrupts() {}
+static inline void interrupts() {}
+
+// Just enough of Print for swireTraceDump; Serial writes to stdout
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  size_t print(const char *text);
+  size_t print(char c);
+  size_t print(unsigned long n);
+  size_t print(long n);
+  size_t println();
+};
+
+class MockSerial : public Print
+{
+public:
+  size_t write(uint8_t c) override;
+};
+
+extern MockSerial Serial;
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+// Simulated time control for the harness
+uint64_t mockMicros();
+void mockAdvance(uint64_t us);
+
+// Pin nets for the harness: mockHoldPin pulls a net low, or lets go of it,
+// on behalf of a device outside the firmware; mockOnPinChange, when set, is
+// called whenever a net changes level. The mock bus uses both to hold SDA.
+void mockHoldPin(uint8_t pin, bool low);
+extern void (*mockOnPinChange)(uint8_t pin, int level);
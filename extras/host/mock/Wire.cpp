@@ -0,0 +1,414 @@
+/** @file Wire.cpp
+ *  @brief Simulated I2C bus behind the host TwoWire.
+ *
+ *  @author Sebastian Mason (sebski123)
+ */
+#include "Wire.h"
+
+#define START_STOP_BITS 2
+#define BITS_PER_BYTE 9 // 8 data bits and the acknowledge
+
+// Constant initialised, so it is ready before any global TwoWire begins
+mockBus_t mockBus = {{NULL}, 100000, 0, 1, NULL, 0, 0, 0, 0, 0};
+TwoWire Wire;
+
+/** @brief Zeroes the bus's traffic counters
+ */
+void mockBusClearCounters()
+{
+  mockBus.transactions = 0;
+  mockBus.bytes = 0;
+  mockBus.bit_errors = 0;
+  mockBus.busy_us = 0;
+}
+
+/** @brief Counts SCL pulses towards the slaves holding SDA
+ */
+static void onPinChange(uint8_t pin, int level)
+{
+  if (pin != PIN_WIRE_SCL || level != HIGH)
+  {
+    return;
+  }
+  for (uint8_t address = 0; address < 128; address++)
+  {
+    TwoWire *slave = mockBus.slaves[address];
+    if (slave && slave->sda_held > 0 && --slave->sda_held == 0)
+    {
+      mockBus.sda_holders--;
+      mockHoldPin(PIN_WIRE_SDA, false);
+    }
+  }
+}
+
+/** @brief Has a slave hold SDA low, as one that lost track of a transfer
+ *         part way through a byte does
+ *
+ *  @param slave   The slave to hold it
+ *  @param clocks  The SCL pulses it takes to let go, 0 to let go now
+ */
+void mockBusHoldSda(TwoWire *slave, uint8_t clocks)
+{
+  mockOnPinChange = onPinChange;
+  if ((slave->sda_held == 0) != (clocks == 0))
+  {
+    mockBus.sda_holders += (clocks > 0) ? 1 : -1;
+    mockHoldPin(PIN_WIRE_SDA, clocks > 0);
+  }
+  slave->sda_held = clocks;
+}
+
+/** @brief Draws a uniform random number in [0, 1) from the bus's own PRNG
+ *
+ *  A xorshift32 seeded from mockBus.seed, so that runs with the same seed
+ *  see the same errors.
+ */
+static double mockRandom()
+{
+  uint32_t x = mockBus.seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  mockBus.seed = x;
+  return (x >> 8) / 16777216.0;
+}
+
+/** @brief Moves one byte across the bus, corrupting it at the configured rates
+ *
+ *  @param slave  The slave taking part in the transfer
+ *  @param data   The byte as sent
+ *  @return The byte as received
+ */
+uint8_t mockBus_t::transfer(TwoWire *slave, uint8_t data)
+{
+  bytes++;
+  if (bit_error_rate > 0)
+  {
+    for (uint8_t bit = 0; bit < 8; bit++)
+    {
+      if (mockRandom() < bit_error_rate)
+      {
+        data ^= 1 << bit;
+        bit_errors++;
+      }
+    }
+  }
+  if (clock > slave->max_clock && mockRandom() < 1.0 / MOCK_OVERCLOCK_ERROR_DIV)
+  {
+    data ^= 1 << (uint8_t)(mockRandom() * 8);
+    bit_errors++;
+  }
+  return data;
+}
+
+/** @brief Advances the simulated clock by a number of bit times
+ */
+void mockBus_t::clockBits(unsigned long bits)
+{
+  uint64_t us = ((uint64_t)bits * 1000000 + clock - 1) / clock;
+  busy_us += us;
+  mockAdvance(us);
+}
+
+/** @brief Holds the bus while a slave runs one of its callbacks
+ *
+ *  @param slave       The slave running the callback
+ *  @param timeout_us  The master's timeout, 0 for none
+ *  @return Whether the slave was done before the master timed out
+ */
+bool mockBus_t::stretch(TwoWire *slave, uint32_t timeout_us)
+{
+  uint64_t held = slave->stretch_us + (slave->asleep ? slave->wake_us : 0);
+  if (timeout_us > 0 && held > timeout_us)
+  {
+    busy_us += timeout_us;
+    mockAdvance(timeout_us);
+    return false;
+  }
+  if (slave->asleep)
+  {
+    busy_us += slave->wake_us;
+    mockAdvance(slave->wake_us);
+    slave->wake();
+  }
+  busy_us += slave->stretch_us;
+  mockAdvance(slave->stretch_us);
+  return true;
+}
+
+TwoWire::TwoWire()
+{
+  max_clock = 0xFFFFFFFF;
+  stretch_us = 0;
+  wake_us = 0;
+  asleep = false;
+  asleep_since = 0;
+  slept_us = 0;
+  sda_held = 0;
+  _timeout_us = 0;
+  _timeout_flag = false;
+  _rx_length = 0;
+  _rx_index = 0;
+  _tx_length = 0;
+  _tx_address = 0;
+  _address = -1;
+  _on_receive = NULL;
+  _on_request = NULL;
+}
+
+/** @brief Joins the bus as a master
+ */
+void TwoWire::begin()
+{
+  end();
+}
+
+/** @brief Joins the bus as a slave at an address
+ */
+void TwoWire::begin(uint8_t address)
+{
+  end();
+  if (address < 128)
+  {
+    _address = address;
+    mockBus.slaves[address] = this;
+  }
+}
+
+/** @brief Leaves the bus
+ */
+void TwoWire::end()
+{
+  if (_address >= 0 && mockBus.slaves[_address] == this)
+  {
+    mockBus.slaves[_address] = NULL;
+  }
+  _address = -1;
+  wake();
+}
+
+/** @brief Marks the device asleep, to be woken by the next callback
+ */
+void TwoWire::sleep()
+{
+  if (!asleep)
+  {
+    asleep = true;
+    asleep_since = mockMicros();
+  }
+}
+
+/** @brief Wakes the device, adding the time it slept to slept_us
+ */
+void TwoWire::wake()
+{
+  if (asleep)
+  {
+    asleep = false;
+    slept_us += mockMicros() - asleep_since;
+  }
+}
+
+/** @brief Sets the clock of the whole bus, as the master does on hardware
+ */
+void TwoWire::setClock(uint32_t clock_hz)
+{
+  if (clock_hz > 0)
+  {
+    mockBus.clock = clock_hz;
+  }
+}
+
+/** @brief Sets how long a master waits on the bus before giving up
+ *
+ *  The TWI is always reset on a timeout, whatever reset_with_timeout says.
+ */
+void TwoWire::setWireTimeout(uint32_t timeout_us, bool reset_with_timeout)
+{
+  (void)reset_with_timeout;
+  _timeout_us = timeout_us;
+  _timeout_flag = false;
+}
+
+/** @brief Gives up on a transaction after a wait, as Wire does on a timeout
+ *
+ *  @param waited_us  How long the master has been held
+ *  @return The endTransmission status for it
+ */
+uint8_t TwoWire::timedOut(uint32_t waited_us)
+{
+  if (waited_us > 0)
+  {
+    mockBus.busy_us += waited_us;
+    mockAdvance(waited_us);
+  }
+  if (_timeout_us == 0)
+  {
+    return 4;
+  }
+  _timeout_flag = true;
+  return 5;
+}
+
+void TwoWire::beginTransmission(uint8_t address)
+{
+  _tx_address = address;
+  _tx_length = 0;
+}
+
+/** @brief Writes the buffered bytes to the slave
+ *
+ *  Address 0 is a general call and reaches every slave.
+ *
+ *  @return 0 on success, 2 if no slave acknowledged the address, 5 on a
+ *          timeout and 4 on a stuck bus without one
+ */
+uint8_t TwoWire::endTransmission(uint8_t send_stop)
+{
+  (void)send_stop;
+  if (mockBus.on_transaction)
+  {
+    mockBus.on_transaction();
+  }
+  mockBus.transactions++;
+  if (mockBus.sda_holders > 0)
+  {
+    return timedOut(_timeout_us ? _timeout_us : MOCK_HANG_US);
+  }
+
+  if (_tx_address == 0)
+  {
+    mockBus.clockBits(START_STOP_BITS + BITS_PER_BYTE * (1 + _tx_length));
+    for (uint8_t address = 1; address < 128; address++)
+    {
+      TwoWire *slave = mockBus.slaves[address];
+      if (slave && slave != this)
+      {
+        for (uint8_t i = 0; i < _tx_length; i++)
+        {
+          slave->_rx_buffer[i] = mockBus.transfer(slave, _tx_buffer[i]);
+        }
+        slave->_rx_length = _tx_length;
+        slave->_rx_index = 0;
+        if (slave->_on_receive)
+        {
+          if (!mockBus.stretch(slave, _timeout_us))
+          {
+            return timedOut(0);
+          }
+          slave->_on_receive(_tx_length);
+        }
+      }
+    }
+    return 0;
+  }
+
+  TwoWire *slave = (_tx_address < 128) ? mockBus.slaves[_tx_address] : NULL;
+  if (slave == NULL || slave == this)
+  {
+    mockBus.clockBits(START_STOP_BITS + BITS_PER_BYTE);
+    return 2;
+  }
+  mockBus.clockBits(START_STOP_BITS + BITS_PER_BYTE * (1 + _tx_length));
+  for (uint8_t i = 0; i < _tx_length; i++)
+  {
+    slave->_rx_buffer[i] = mockBus.transfer(slave, _tx_buffer[i]);
+  }
+  slave->_rx_length = _tx_length;
+  slave->_rx_index = 0;
+  if (slave->_on_receive && _tx_length > 0)
+  {
+    if (!mockBus.stretch(slave, _timeout_us))
+    {
+      return timedOut(0);
+    }
+    slave->_on_receive(_tx_length);
+  }
+  return 0;
+}
+
+/** @brief Reads bytes from a slave
+ *
+ *  @return The number of bytes read, quantity if the slave acknowledged its
+ *          address and 0 otherwise
+ */
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity)
+{
+  if (mockBus.on_transaction)
+  {
+    mockBus.on_transaction();
+  }
+  mockBus.transactions++;
+  _rx_length = 0;
+  _rx_index = 0;
+  if (mockBus.sda_holders > 0)
+  {
+    timedOut(_timeout_us ? _timeout_us : MOCK_HANG_US);
+    return 0;
+  }
+
+  TwoWire *slave = (address > 0 && address < 128) ? mockBus.slaves[address] : NULL;
+  if (slave == NULL || slave == this)
+  {
+    mockBus.clockBits(START_STOP_BITS + BITS_PER_BYTE);
+    return 0;
+  }
+  if (quantity > BUFFER_LENGTH)
+  {
+    quantity = BUFFER_LENGTH;
+  }
+  slave->_tx_length = 0;
+  mockBus.clockBits(START_STOP_BITS + BITS_PER_BYTE); // The ISR runs on its address
+  if (slave->_on_request)
+  {
+    if (!mockBus.stretch(slave, _timeout_us))
+    {
+      timedOut(0);
+      return 0;
+    }
+    slave->_on_request();
+  }
+  mockBus.clockBits(BITS_PER_BYTE * quantity);
+  for (uint8_t i = 0; i < quantity; i++)
+  {
+    uint8_t data = (i < slave->_tx_length) ? slave->_tx_buffer[i] : 0xFF;
+    _rx_buffer[i] = mockBus.transfer(slave, data);
+  }
+  _rx_length = quantity;
+  return quantity;
+}
+
+size_t TwoWire::write(uint8_t data)
+{
+  if (_tx_length >= BUFFER_LENGTH)
+  {
+    return 0;
+  }
+  _tx_buffer[_tx_length++] = data;
+  return 1;
+}
+
+size_t TwoWire::write(const uint8_t *data, size_t length)
+{
+  size_t written = 0;
+  while (written < length && write(data[written]))
+  {
+    written++;
+  }
+  return written;
+}
+
+int TwoWire::available()
+{
+  return _rx_length - _rx_index;
+}
+
+int TwoWire::read()
+{
+  return (_rx_index < _rx_length) ? _rx_buffer[_rx_index++] : -1;
+}
+
+int TwoWire::peek()
+{
+  return (_rx_index < _rx_length) ? _rx_buffer[_rx_index] : -1;
+}
@@ -0,0 +1,130 @@
+/** @file Wire.h
+ *  @brief Host stand-in for the Arduino TwoWire class.
+ *
+ *  Every TwoWire object sits on one simulated I2C bus (mockBus). A master
+ *  transaction calls the addressed slave's onReceive or onRequest callback in
+ *  line, the way the AVR core does from its TWI interrupt, and advances the
+ *  simulated clock by the time the transfer would take on the wire:
+ *    - 9 bit times per byte, address included, plus start and stop, at the
+ *      clock last set with setClock.
+ *    - The slave's stretch_us for every callback it runs, standing in for
+ *      clock stretching while its ISR works.
+ *    - The slave's wake_us before the first callback after it went to
+ *      sleep, standing in for the MCU's start up time.
+ *  A master that set a timeout with setWireTimeout gives up on a slave that
+ *  holds the clock for longer, as the AVR core does, skipping the callback.
+ *  While a slave holds SDA low (mockBusHoldSda) no transaction can start,
+ *  and each one waits out the timeout, or MOCK_HANG_US without one. The
+ *  slave lets go after a number of SCL pulses on PIN_WIRE_SCL, which is how
+ *  a master recovers the bus.
+ *  Bytes are corrupted at random on their way across:
+ *    - Each bit flips with probability mockBus.bit_error_rate.
+ *    - A slave driven faster than its max_clock loses one byte in
+ *      MOCK_OVERCLOCK_ERROR_DIV.
+ *
+ *  Like the AVR core, a request is always answered with the number of bytes
+ *  asked for, padded with 0xFF past what the slave wrote, and writes past
+ *  BUFFER_LENGTH are dropped.
+ *
+ *  @author Sebastian Mason (sebski123)
+ */
+#pragma once
+#include "Arduino.h"
+
+#define BUFFER_LENGTH 32
+#define MOCK_OVERCLOCK_ERROR_DIV 4
+#define MOCK_HANG_US 1000000 // How long a stuck bus holds a master with no timeout
+#define WIRE_HAS_TIMEOUT
+
+class TwoWire
+{
+public:
+  TwoWire();
+
+  void begin();
+  void begin(uint8_t address);
+  void begin(int address) { begin((uint8_t)address); }
+  void end();
+  void setClock(uint32_t clock_hz);
+
+  void beginTransmission(uint8_t address);
+  void beginTransmission(int address) { beginTransmission((uint8_t)address); }
+  uint8_t endTransmission(uint8_t send_stop = 1);
+  uint8_t requestFrom(uint8_t address, uint8_t quantity);
+  uint8_t requestFrom(int address, int quantity)
+  {
+    return requestFrom((uint8_t)address, (uint8_t)quantity);
+  }
+
+  size_t write(uint8_t data);
+  size_t write(const uint8_t *data, size_t length);
+  size_t write(const char *data) { return write((const uint8_t *)data, strlen(data)); }
+  int available();
+  int read();
+  int peek();
+
+  void onReceive(void (*function)(int)) { _on_receive = function; }
+  void onRequest(void (*function)(void)) { _on_request = function; }
+
+  void setWireTimeout(uint32_t timeout_us = 25000, bool reset_with_timeout = false);
+  bool getWireTimeoutFlag() { return _timeout_flag; }
+  void clearWireTimeoutFlag() { _timeout_flag = false; }
+
+  void sleep();
+  void wake();
+
+  uint32_t max_clock;  // Fastest clock this device handles without errors
+  uint32_t stretch_us; // Time held per callback as a slave
+  uint32_t wake_us;    // Time held waking up as a slave
+  bool asleep;
+  uint64_t asleep_since;
+  uint64_t slept_us;   // Total time asleep, not counting the current sleep
+  uint8_t sda_held;    // SCL pulses until it lets go of SDA, see mockBusHoldSda
+
+private:
+  uint8_t timedOut(uint32_t waited_us);
+  uint32_t _timeout_us; // 0 for none
+  bool _timeout_flag;
+  uint8_t _rx_buffer[BUFFER_LENGTH];
+  uint8_t _rx_length;
+  uint8_t _rx_index;
+  uint8_t _tx_buffer[BUFFER_LENGTH];
+  uint8_t _tx_length;
+  uint8_t _tx_address;
+  int16_t _address; // Own slave address, -1 when not a slave
+  void (*_on_receive)(int);
+  void (*_on_request)(void);
+};
+
+/** @brief The simulated bus shared by every TwoWire object
+ *
+ *  on_transaction, when set, is called at the start of every master
+ *  transaction, before any callback runs. The harness uses it to let the
+ *  other devices' main loops catch up with the simulated clock.
+ */
+struct mockBus_t
+{
+  TwoWire *slaves[128];
+  uint32_t clock;
+  double bit_error_rate;
+  uint32_t seed;
+  void (*on_transaction)();
+
+  // Counters, cleared by mockBusClearCounters
+  unsigned long transactions;
+  unsigned long bytes;
+  unsigned long bit_errors;
+  uint64_t busy_us;
+
+  uint8_t sda_holders; // Slaves holding SDA low
+
+  uint8_t transfer(TwoWire *slave, uint8_t data);
+  void clockBits(unsigned long bits);
+  bool stretch(TwoWire *slave, uint32_t timeout_us);
+};
+
+extern mockBus_t mockBus;
+extern TwoWire Wire;
+
+void mockBusClearCounters();
+void mockBusHoldSda(TwoWire *slave, uint8_t clocks);
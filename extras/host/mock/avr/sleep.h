@@ -0,0 +1,22 @@
+/** @file sleep.h
+ *  @brief Host stand-in for the AVR sleep functions.
+ *
+ *  The host can't sleep, so sleep_cpu returns straight away. The harness
+ *  marks a device's TwoWire asleep instead once its client has slept, and
+ *  the mock bus wakes it on the next transaction that reaches it.
+ *
+ *  @author Sebastian Mason (sebski123)
+ */
+#pragma once
+#include <stdint.h>
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_ADC 1
+#define SLEEP_MODE_PWR_DOWN 2
+#define SLEEP_MODE_PWR_SAVE 3
+#define SLEEP_MODE_STANDBY 6
+
+static inline void set_sleep_mode(uint8_t mode) { (void)mode; }
+static inline void sleep_enable() {}
+static inline void sleep_disable() {}
+static inline void sleep_cpu() {}
@@ -0,0 +1,120 @@
+#include "messageQueue.h"
+
+// Each side reads the index the other side writes with acquire semantics
+// and publishes its own with release semantics, so the contents of a record
+// are written before the producer's head makes it visible, and read before
+// the consumer's tail hands it back. That is all the single-producer/
+// single-consumer case needs, on weakly ordered cores (ESP32, RP2040, ...)
+// as well. On AVR, 8-bit loads and stores are atomic and never reordered by
+// the hardware, so only the compiler needs holding back.
+#if defined(__AVR__)
+static inline uint8_t loadAcquire(volatile uint8_t *index) {
+	uint8_t value = *index;
+	__asm__ __volatile__("" ::: "memory");
+	return value;
+}
+
+static inline void storeRelease(volatile uint8_t *index, uint8_t value) {
+	__asm__ __volatile__("" ::: "memory");
+	*index = value;
+}
+#else
+static inline uint8_t loadAcquire(volatile uint8_t *index) {
+	return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+static inline void storeRelease(volatile uint8_t *index, uint8_t value) {
+	__atomic_store_n(index, value, __ATOMIC_RELEASE);
+}
+#endif
+
+static char *recordAt(messageQueue_t *q, uint8_t index) {
+	return q->data + (uint16_t)(index & q->mask) * q->record_size;
+}
+
+int messageQueueInit(messageQueue_t *q, char *storage, uint8_t capacity, uint8_t record_size) {
+	// Capacity must be a non-zero power of two no larger than 128 so that the
+	// free-running counters can always tell a full queue from an empty one.
+	if(storage == NULL || capacity == 0 || capacity > 128 || (capacity & (capacity - 1)) != 0) {
+		return 0;
+	}
+	q->data = storage;
+	q->record_size = record_size;
+	q->mask = capacity - 1;
+	q->head = 0;
+	q->tail = 0;
+	q->high_water = 0;
+	return 1;
+}
+
+char *messageQueueReserve(messageQueue_t *q) {
+	return messageQueueReserveAt(q, 0);
+}
+
+char *messageQueueReserveAt(messageQueue_t *q, uint8_t offset) {
+	uint8_t head = q->head;
+	if((uint16_t)(uint8_t)(head - loadAcquire(&q->tail)) + offset > q->mask) {
+		return NULL;
+	}
+	return recordAt(q, head + offset);
+}
+
+void messageQueueCommit(messageQueue_t *q) {
+	messageQueueCommitN(q, 1);
+}
+
+void messageQueueCommitN(messageQueue_t *q, uint8_t n) {
+	uint8_t head = q->head;
+	uint16_t count = (uint16_t)(uint8_t)(head - loadAcquire(&q->tail)) + n;
+	if(n == 0 || count > (uint16_t)q->mask + 1) {
+		return;
+	}
+	storeRelease(&q->head, head + n);
+	if(count > q->high_water) {
+		q->high_water = count;
+	}
+}
+
+char *messageQueuePeek(messageQueue_t *q) {
+	return messageQueuePeekAt(q, 0);
+}
+
+char *messageQueuePeekAt(messageQueue_t *q, uint8_t offset) {
+	uint8_t tail = q->tail;
+	if((uint8_t)(loadAcquire(&q->head) - tail) <= offset) {
+		return NULL;
+	}
+	return recordAt(q, tail + offset);
+}
+
+void messageQueuePop(messageQueue_t *q) {
+	messageQueuePopN(q, 1);
+}
+
+void messageQueuePopN(messageQueue_t *q, uint8_t n) {
+	uint8_t tail = q->tail;
+	if(n == 0 || (uint8_t)(loadAcquire(&q->head) - tail) < n) {
+		return;
+	}
+	storeRelease(&q->tail, tail + n);
+}
+
+uint8_t messageQueueCount(messageQueue_t *q) {
+	return (uint8_t)(loadAcquire(&q->head) - loadAcquire(&q->tail));
+}
+
+uint8_t messageQueueSpace(messageQueue_t *q) {
+	return (uint8_t)(q->mask + 1 - messageQueueCount(q));
+}
+
+uint8_t messageQueueHighWater(messageQueue_t *q) {
+	return q->high_water;
+}
+
+int messageQueueIsEmpty(messageQueue_t *q) {
+	return loadAcquire(&q->head) == loadAcquire(&q->tail);
+}
+
+int messageQueueIsFull(messageQueue_t *q) {
+	return messageQueueCount(q) > q->mask;
+}
@@ -0,0 +1,53 @@
+/** @file messageQueue.h
+ *  @brief Headers and definitions for a FIFO queue of fixed-size records.
+ *
+ *  Records are stored inline in one contiguous buffer supplied by the
+ *  caller, so queueing a message needs no allocation. The capacity must be a power of two; head and tail are free-running 8-bit
+ *  counters that are masked on use, so no division is ever needed.
+ *
+ *  Producers call messageQueueReserve() to get the next free record, fill it
+ *  in place, then publish it with messageQueueCommit(). Consumers read the
+ *  oldest record in place with messageQueuePeek() and drop it with
+ *  messageQueuePop().
+ *
+ *  Several records can be filled or read before publishing or releasing them
+ *  together using the ...At and ...N variants.
+ *
+ *  The queue is lock-free for one producer and one consumer, which may run in
+ *  different contexts (e.g. the Wire ISR and the main loop). Only the producer
+ *  writes head and only the consumer writes tail; a record is published by
+ *  advancing head after its contents are written, and released by advancing
+ *  tail after the consumer is done with it. Each index is read with acquire
+ *  and written with release ordering, so this holds on weakly ordered cores
+ *  as well as on AVR. Neither side needs to disable interrupts.
+ *  Reserve/Commit must only be called by the producer and Peek/Pop only by
+ *  the consumer.
+ *
+ *  @author Sebastian Mason (sebski123)
+ */
+#pragma once
+#include "Arduino.h"
+
+typedef struct {
+	char *data;
+	uint8_t record_size;
+	uint8_t mask;
+	volatile uint8_t head;   // Written by the producer only
+	volatile uint8_t tail;   // Written by the consumer only
+	uint8_t high_water;      // Written by the producer only
+} messageQueue_t;
+
+int messageQueueInit(messageQueue_t *q, char *storage, uint8_t capacity, uint8_t record_size);
+char *messageQueueReserve(messageQueue_t *q);
+char *messageQueueReserveAt(messageQueue_t *q, uint8_t offset);
+void messageQueueCommit(messageQueue_t *q);
+void messageQueueCommitN(messageQueue_t *q, uint8_t n);
+char *messageQueuePeek(messageQueue_t *q);
+char *messageQueuePeekAt(messageQueue_t *q, uint8_t offset);
+void messageQueuePop(messageQueue_t *q);
+void messageQueuePopN(messageQueue_t *q, uint8_t n);
+uint8_t messageQueueCount(messageQueue_t *q);
+uint8_t messageQueueSpace(messageQueue_t *q);
+uint8_t messageQueueHighWater(messageQueue_t *q);
+int messageQueueIsEmpty(messageQueue_t *q);
+int messageQueueIsFull(messageQueue_t *q);